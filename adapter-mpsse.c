@@ -20,31 +20,175 @@
 #include <fcntl.h>
 #include <string.h>
 #include <errno.h>
-#include <usb.h>
+#ifdef LIBUSB1
+#   include <libusb-1.0/libusb.h>
+#else
+#   include <usb.h>
+#endif
+#ifdef IOTHREAD
+#   include <pthread.h>
+#endif
+#ifdef __SSE2__
+#   include <emmintrin.h>
+#endif
 
 #include "adapter.h"
 #include "arm-jtag.h"
 
+typedef struct _mpsse_adapter_t mpsse_adapter_t;
+
+/*
+ * Устройство в цепочке JTAG. Каждому устройству соответствует свой
+ * экземпляр adapter_t; соединение USB, буферы и очередь чтений общие.
+ */
+#define SCAN_DR_MAX     48      /* наибольшая длина пакета сканирования DR */
+#define SCAN_IR_MAX     96      /* наибольшая длина пакета сканирования IR */
+
 typedef struct {
     /* Общая часть */
     adapter_t adapter;
 
+    mpsse_adapter_t *dev;       /* адаптер, к которому подключена цепочка */
+    int index;                  /* позиция в цепочке, 0 - ближайшее к TDO */
+    int irlen;                  /* длина регистра команд */
+
+    /* Копии регистров DP_SELECT, CSW и TAR, чтобы не повторять
+     * запись того же значения. Флаг valid сброшен, если значение
+     * в целевом процессоре неизвестно. */
+    unsigned select, csw, tar;
+    int select_valid, csw_valid, tar_valid;
+
+    /* Проверка залипающих флагов при flush(): used - с момента
+     * проверки были обращения к DP и AP, wrote - записи в память
+     * (DRW, BD0-BD3), которые адаптер повторить не может,
+     * stat - прочитанное значение CTRL/STAT, failed - пакет этого
+     * устройства не прошёл, lost - о потере записей ещё не сообщено
+     * через stalled. */
+    int used, wrote, failed, lost;
+    unsigned stat;
+
+    /* Шаблоны сканирования DR (без чтения и с чтением) и IR
+     * с битами для остальных устройств цепочки в режиме BYPASS.
+     * Смещения указывают, куда подставлять данные. */
+    unsigned char dr_template [2] [SCAN_DR_MAX];
+    int dr_size;
+    int dr_data;                /* биты 0-31 */
+    int dr_high;                /* бит 34 */
+    int dr_high_pos;            /* номер бита 34 в байте */
+    unsigned char ir_template [SCAN_IR_MAX];
+    int ir_size;
+    int ir_data;                /* младшие биты команды */
+    int ir_last;                /* старший бит команды, -1 если в ir_data */
+} mpsse_tap_t;
+
+struct _mpsse_adapter_t {
+#ifdef LIBUSB1
+    /* Доступ к устройству через libusb-1.0.
+     * Несколько передач OUT и IN ставятся в очередь одновременно,
+     * чтобы микросхема FTDI не простаивала между пакетами. */
+#define NUM_OUT 4
+#define NUM_IN  4
+    libusb_context *usbctx;
+    libusb_device_handle *usbdev;
+    struct libusb_transfer *out_xfer [NUM_OUT];
+    unsigned char out_buf [NUM_OUT] [256*16];
+    int out_done [NUM_OUT];
+    int out_next;
+    struct libusb_transfer *in_xfer [NUM_IN];
+    unsigned char in_buf [NUM_IN] [4096 + 512];
+    int in_done [NUM_IN];
+#else
     /* Доступ к устройству через libusb. */
     usb_dev_handle *usbdev;
+#endif
+
+#ifdef IOTHREAD
+    /* Поток ввода-вывода USB и кольцевой буфер пакетов MPSSE для него.
+     * Индекс ring_head изменяет только вызывающий поток, ring_tail -
+     * только поток ввода-вывода; блокировка нужна лишь для того,
+     * чтобы разбудить уснувшую сторону. */
+#define RING_SIZE 8             /* степень двойки */
+    pthread_t iothread;
+    struct {
+        unsigned char data [256*16];
+        int nbytes;             /* длина пакета, -1 - завершение потока */
+        int reply;              /* после записи принять ответ */
+    } ring [RING_SIZE];
+    unsigned ring_head;         /* число поставленных пакетов */
+    unsigned ring_tail;         /* число выполненных пакетов */
+    int producer_sleeping;
+    int consumer_sleeping;
+    pthread_mutex_t ring_lock;
+    pthread_cond_t ring_cond;
+#endif
 
     /* Буфер для посылаемого пакета MPSSE. */
     unsigned char output [256*16];
     int bytes_to_write;
 
     /* Буфер для принятых данных. */
-    unsigned char input [64];
+    unsigned char *input;
+    int input_size;
+    int bytes_received;
     int bytes_to_read;
-    int bytes_per_word;
-    unsigned long long fix_high_bit;
-    unsigned long long high_byte_mask;
-    unsigned long long high_bit_mask;
-    unsigned high_byte_bits;
-} mpsse_adapter_t;
+    int max_packet;             /* размер пакета USB */
+    int max_reply;              /* размер буфера передачи FTDI */
+    int ft2232h;                /* микросхема FT2232H */
+    unsigned tck_khz;           /* частота TCK */
+    unsigned latency;           /* таймер задержки FTDI, мсек */
+    char serial [64];           /* серийный номер адаптера */
+
+    /* Цепочка JTAG; tap - устройство текущей операции. */
+    mpsse_tap_t taps [MAX_TAPS];
+    int ntaps;
+    mpsse_tap_t *tap;
+    int nopen;                  /* число открытых экземпляров adapter_t */
+    int reply_shift;            /* положение бита 34 в ответе */
+
+    /* Текущее значение регистра команд JTAG, -1 если неизвестно,
+     * и устройство, для которого оно загружено (у остальных BYPASS). */
+    int ir;
+    mpsse_tap_t *ir_tap;
+
+    /* Режим SWD; swd_drive - линия SWDIO управляется адаптером. */
+    int swd;
+    int swd_drive;
+
+    /* Очередь отложенных чтений, в порядке следования ответов. */
+    struct {
+        mpsse_tap_t *tap;       /* устройство в цепочке */
+        unsigned *data;         /* куда поместить значение */
+        int dp;                 /* чтение регистра DP: WAIT допустим */
+        int reg;                /* регистр, для повтора чтения */
+        unsigned addr;          /* адрес слова для DRW или NO_ADDR */
+    } *queue;
+    int queue_len;
+    int queue_size;
+
+    /* Чтение MEM-AP, значение которого ещё не запрошено: оно придёт
+     * при следующем чтении DPACC/APACC этого устройства. */
+    struct {
+        mpsse_tap_t *tap;       /* 0 - нет такого чтения */
+        unsigned *data;
+        int reg;
+        unsigned addr;
+    } pending;
+
+    /* Разобранные ответы на отложенные чтения: значение и ACK. */
+    unsigned *reply_value;
+    unsigned char *reply_ack;
+};
+
+/*
+ * Выбор устройства цепочки для операции через его экземпляр adapter_t.
+ */
+static mpsse_adapter_t *mpsse_tap (adapter_t *adapter)
+{
+    mpsse_tap_t *t = (mpsse_tap_t*) adapter;
+
+    t->dev->tap = t;
+    return t->dev;
+}
 
 /*
  * Можно использовать готовый адаптер Olimex ARM-USB-Tiny с переходником
@@ -60,6 +204,11 @@ typedef struct {
  * /SYSRST      15              6
  *  GND         4,6,8,10,12,    2,8
  *              14,16,18,20
+ *
+ * Для режима SWD используется переходник Olimex ARM-JTAG-SWD:
+ * SWDIO выдаётся с TDI через буфер, разрешённый сигналом TMS,
+ * и принимается на TDO; SWCLK - это TCK. Переходник включается
+ * активным уровнем /TRST, поэтому в режиме SWD он всегда активен.
  */
 
 /*
@@ -111,12 +260,185 @@ typedef struct {
 
 static unsigned jtag_adapter_version = 0;
 
+#ifdef LIBUSB1
+/*
+ * Завершение асинхронной передачи USB.
+ */
+static void usb_transfer_done (struct libusb_transfer *xfer)
+{
+    *(int*) xfer->user_data = 1;
+}
+
+/*
+ * Ожидание завершения передачи USB.
+ */
+static void usb_wait (mpsse_adapter_t *a, int *done)
+{
+    while (! *done)
+        libusb_handle_events_completed (a->usbctx, done);
+}
+
+/*
+ * Поиск адаптера и открытие устройства.
+ * Возвращает 0, если адаптер не найден или недоступен.
+ */
+static int usb_open_adapter (mpsse_adapter_t *a)
+{
+    libusb_device **list, *dev = 0;
+    struct libusb_device_descriptor desc;
+    ssize_t ndev, i;
+    int err;
+
+    if (libusb_init (&a->usbctx) != 0)
+        return 0;
+    ndev = libusb_get_device_list (a->usbctx, &list);
+    for (i=0; i<ndev; i++) {
+        if (libusb_get_device_descriptor (list[i], &desc) == 0 &&
+            desc.idVendor == OLIMEX_VID &&
+            (desc.idProduct == OLIMEX_ARM_USB_OCD ||
+             desc.idProduct == OLIMEX_ARM_USB_TINY ||
+             desc.idProduct == OLIMEX_ARM_USB_TINY_H ||
+             desc.idProduct == OLIMEX_ARM_USB_OCD_H)) {
+            dev = list[i];
+            break;
+        }
+    }
+    if (! dev) {
+        libusb_free_device_list (list, 1);
+        libusb_exit (a->usbctx);
+        return 0;
+    }
+    jtag_adapter_version = desc.idProduct;
+    err = libusb_open (dev, &a->usbdev);
+    libusb_free_device_list (list, 1);
+    if (err != 0) {
+        if (err == LIBUSB_ERROR_ACCESS)
+            fprintf (stderr, "MPSSE adapter: superuser privileges needed.\n");
+        else
+            fprintf (stderr, "MPSSE adapter: libusb_open() failed\n");
+        libusb_exit (a->usbctx);
+        return 0;
+    }
+    libusb_claim_interface (a->usbdev, 0);
+    if (desc.iSerialNumber)
+        libusb_get_string_descriptor_ascii (a->usbdev, desc.iSerialNumber,
+            (unsigned char*) a->serial, sizeof (a->serial));
+
+    for (i=0; i<NUM_OUT; i++) {
+        a->out_xfer[i] = libusb_alloc_transfer (0);
+        a->out_done[i] = 1;
+    }
+    for (i=0; i<NUM_IN; i++) {
+        a->in_xfer[i] = libusb_alloc_transfer (0);
+        a->in_done[i] = 1;
+    }
+    return 1;
+}
+
+/*
+ * Закрытие устройства: дожидаемся окончания всех передач.
+ */
+static void usb_close_adapter (mpsse_adapter_t *a)
+{
+    int i;
+
+    for (i=0; i<NUM_OUT; i++) {
+        usb_wait (a, &a->out_done[i]);
+        libusb_free_transfer (a->out_xfer[i]);
+    }
+    for (i=0; i<NUM_IN; i++)
+        libusb_free_transfer (a->in_xfer[i]);
+    libusb_release_interface (a->usbdev, 0);
+    libusb_close (a->usbdev);
+    libusb_exit (a->usbctx);
+}
+
+/*
+ * Управляющий запрос к микросхеме FTDI.
+ * Возвращает количество переданных байтов или отрицательный код ошибки.
+ */
+static int ftdi_control (mpsse_adapter_t *a, int in, int request,
+    int value, unsigned char *data, int nbytes)
+{
+    return libusb_control_transfer (a->usbdev,
+        LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE |
+        (in ? LIBUSB_ENDPOINT_IN : LIBUSB_ENDPOINT_OUT),
+        request, value, 1, data, nbytes, 1000);
+}
+#else
+/*
+ * Поиск адаптера и открытие устройства.
+ * Возвращает 0, если адаптер не найден.
+ */
+static int usb_open_adapter (mpsse_adapter_t *a)
+{
+    struct usb_bus *bus;
+    struct usb_device *dev;
+
+    usb_init();
+    usb_find_busses();
+    usb_find_devices();
+    for (bus = usb_get_busses(); bus; bus = bus->next) {
+        for (dev = bus->devices; dev; dev = dev->next) {
+            if (dev->descriptor.idVendor == OLIMEX_VID &&
+                (dev->descriptor.idProduct == OLIMEX_ARM_USB_OCD ||
+                 dev->descriptor.idProduct == OLIMEX_ARM_USB_TINY ||
+                 dev->descriptor.idProduct == OLIMEX_ARM_USB_TINY_H ||
+                 dev->descriptor.idProduct == OLIMEX_ARM_USB_OCD_H))
+                goto found;
+        }
+    }
+    /*fprintf (stderr, "USB adapter not found: vid=%04x, pid=%04x\n",
+        OLIMEX_VID, OLIMEX_PID);*/
+    return 0;
+found:
+    /*fprintf (stderr, "found USB adapter: vid %04x, pid %04x, type %03x\n",
+        dev->descriptor.idVendor, dev->descriptor.idProduct,
+        dev->descriptor.bcdDevice);*/
+    jtag_adapter_version = dev->descriptor.idProduct;
+    a->usbdev = usb_open (dev);
+    if (! a->usbdev) {
+        fprintf (stderr, "MPSSE adapter: usb_open() failed\n");
+        return 0;
+    }
+    usb_claim_interface (a->usbdev, 0);
+    if (dev->descriptor.iSerialNumber)
+        usb_get_string_simple (a->usbdev, dev->descriptor.iSerialNumber,
+            a->serial, sizeof (a->serial));
+    return 1;
+}
+
+static void usb_close_adapter (mpsse_adapter_t *a)
+{
+    usb_release_interface (a->usbdev, 0);
+    usb_close (a->usbdev);
+}
+
+/*
+ * Управляющий запрос к микросхеме FTDI.
+ * Возвращает количество переданных байтов или отрицательный код ошибки.
+ */
+static int ftdi_control (mpsse_adapter_t *a, int in, int request,
+    int value, unsigned char *data, int nbytes)
+{
+    return usb_control_msg (a->usbdev,
+        USB_TYPE_VENDOR | USB_RECIP_DEVICE |
+        (in ? USB_ENDPOINT_IN : USB_ENDPOINT_OUT),
+        request, value, 1, (char*) data, nbytes, 1000);
+}
+#endif
+
 /*
  * Посылка пакета данных USB-устройству.
  */
-static void bulk_write (mpsse_adapter_t *a, unsigned char *output, int nbytes)
+static void bulk_send (mpsse_adapter_t *a, unsigned char *output, int nbytes)
 {
+#ifdef LIBUSB1
+    struct libusb_transfer *xfer;
+    int k;
+#else
     int bytes_written;
+#endif
 
     if (debug_level > 1) {
         int i;
@@ -125,420 +447,2105 @@ static void bulk_write (mpsse_adapter_t *a, unsigned char *output, int nbytes)
             fprintf (stderr, "%c%02x", i ? '-' : ' ', output[i]);
         fprintf (stderr, "\n");
     }
+#ifdef LIBUSB1
+    /* Передача только ставится в очередь; ждём лишь тогда,
+     * когда все буферы заняты. */
+    k = a->out_next;
+    a->out_next = (k + 1) % NUM_OUT;
+    xfer = a->out_xfer[k];
+    usb_wait (a, &a->out_done[k]);
+    if (xfer->length > 0 && (xfer->status != LIBUSB_TRANSFER_COMPLETED ||
+        xfer->actual_length != xfer->length)) {
+        /* Предыдущая передача из этого буфера не прошла. */
+        fprintf (stderr, "usb bulk write failed\n");
+        exit (-1);
+    }
+    memcpy (a->out_buf[k], output, nbytes);
+    libusb_fill_bulk_transfer (xfer, a->usbdev, IN_EP, a->out_buf[k],
+        nbytes, usb_transfer_done, &a->out_done[k], 1000);
+    a->out_done[k] = 0;
+    if (libusb_submit_transfer (xfer) != 0) {
+        fprintf (stderr, "usb bulk write failed\n");
+        exit (-1);
+    }
+#else
     bytes_written = usb_bulk_write (a->usbdev, IN_EP, (char*) output,
         nbytes, 1000);
     if (bytes_written < 0) {
         fprintf (stderr, "usb bulk write failed\n");
         exit (-1);
     }
-    if (bytes_written != nbytes)
-        fprintf (stderr, "usb bulk written %d bytes of %d",
-            bytes_written, nbytes);
+    if (bytes_written != nbytes)
+        fprintf (stderr, "usb bulk written %d bytes of %d",
+            bytes_written, nbytes);
+#endif
+}
+
+/*
+ * Размер запроса на чтение для получения nbytes байтов ответа.
+ * Каждый пакет USB начинается с двух байтов состояния модема.
+ */
+static int bulk_read_size (mpsse_adapter_t *a, int nbytes, int limit)
+{
+    int n = nbytes;
+
+    n += 2 * ((n + a->max_packet - 3) / (a->max_packet - 2));
+    n = (n + a->max_packet - 1) / a->max_packet * a->max_packet;
+    if (n > limit)
+        n = limit;
+    return n;
+}
+
+/*
+ * Разбор принятых пакетов USB: байты состояния отбрасываются,
+ * данные добавляются во входной буфер.
+ * Возвращает новое количество принятых байтов ответа.
+ */
+static int bulk_unpack (mpsse_adapter_t *a, unsigned char *reply, int n,
+    int bytes_read)
+{
+    int i, len;
+
+    if (debug_level > 1) {
+        fprintf (stderr, "usb bulk read %d bytes:", n);
+        for (i=0; i<n; i++)
+            fprintf (stderr, "%c%02x", i ? '-' : ' ', reply[i]);
+        fprintf (stderr, "\n");
+    }
+    for (i=0; i<n; i+=a->max_packet) {
+        len = n - i;
+        if (len > a->max_packet)
+            len = a->max_packet;
+        if (len <= 2)
+            continue;
+        len -= 2;
+        if (len > a->bytes_to_read - bytes_read)
+            len = a->bytes_to_read - bytes_read;
+        memcpy (a->input + a->bytes_received + bytes_read,
+            reply + i + 2, len);
+        bytes_read += len;
+    }
+    return bytes_read;
+}
+
+#ifdef LIBUSB1
+/*
+ * Приём ответа длиной bytes_to_read байтов.
+ * В очереди держим до NUM_IN передач IN, чтобы следующий запрос
+ * к адаптеру уже ждал, пока обрабатывается предыдущий.
+ * Передачи завершаются в порядке постановки в очередь.
+ */
+static void bulk_read_reply (mpsse_adapter_t *a)
+{
+    struct libusb_transfer *xfer;
+    int bytes_read = 0, head = 0, tail = 0, inflight = 0;
+
+    while (bytes_read < a->bytes_to_read) {
+        while (inflight < NUM_IN) {
+            xfer = a->in_xfer[tail];
+            libusb_fill_bulk_transfer (xfer, a->usbdev, OUT_EP,
+                a->in_buf[tail], bulk_read_size (a,
+                    a->bytes_to_read - bytes_read, sizeof (a->in_buf[0])),
+                usb_transfer_done, &a->in_done[tail], 2000);
+            a->in_done[tail] = 0;
+            if (libusb_submit_transfer (xfer) != 0) {
+                fprintf (stderr, "usb bulk read failed\n");
+                exit (-1);
+            }
+            tail = (tail + 1) % NUM_IN;
+            inflight++;
+        }
+        xfer = a->in_xfer[head];
+        usb_wait (a, &a->in_done[head]);
+        if (xfer->status != LIBUSB_TRANSFER_COMPLETED) {
+            fprintf (stderr, "usb bulk read failed\n");
+            exit (-1);
+        }
+        bytes_read = bulk_unpack (a, xfer->buffer, xfer->actual_length,
+            bytes_read);
+        head = (head + 1) % NUM_IN;
+        inflight--;
+    }
+
+    /* Остальные передачи получат только байты состояния: отменяем. */
+    while (inflight > 0) {
+        libusb_cancel_transfer (a->in_xfer[head]);
+        usb_wait (a, &a->in_done[head]);
+        head = (head + 1) % NUM_IN;
+        inflight--;
+    }
+}
+#else
+/*
+ * Приём ответа длиной bytes_to_read байтов.
+ */
+static void bulk_read_reply (mpsse_adapter_t *a)
+{
+    int bytes_read, n;
+    unsigned char reply [4096 + 512];
+
+    bytes_read = 0;
+    while (bytes_read < a->bytes_to_read) {
+        n = bulk_read_size (a, a->bytes_to_read - bytes_read, sizeof (reply));
+        n = usb_bulk_read (a->usbdev, OUT_EP, (char*) reply, n, 2000);
+        if (n < 0) {
+            fprintf (stderr, "usb bulk read failed\n");
+            exit (-1);
+        }
+        bytes_read = bulk_unpack (a, reply, n, bytes_read);
+    }
+}
+#endif
+
+#ifdef IOTHREAD
+/*
+ * Ожидание, пока значение индекса отличается от value.
+ * Флаг sleeping сообщает другой стороне, что нас надо разбудить.
+ */
+static void ring_wait (mpsse_adapter_t *a, unsigned *index, unsigned value,
+    int *sleeping)
+{
+    if (__atomic_load_n (index, __ATOMIC_SEQ_CST) != value)
+        return;
+    pthread_mutex_lock (&a->ring_lock);
+    __atomic_store_n (sleeping, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n (index, __ATOMIC_SEQ_CST) == value)
+        pthread_cond_wait (&a->ring_cond, &a->ring_lock);
+    __atomic_store_n (sleeping, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock (&a->ring_lock);
+}
+
+/*
+ * Продвижение индекса и, при необходимости, пробуждение другой стороны.
+ */
+static void ring_publish (mpsse_adapter_t *a, unsigned *index, unsigned value,
+    int *sleeping)
+{
+    __atomic_store_n (index, value, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n (sleeping, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock (&a->ring_lock);
+        pthread_cond_broadcast (&a->ring_cond);
+        pthread_mutex_unlock (&a->ring_lock);
+    }
+}
+
+/*
+ * Поток ввода-вывода: выбирает пакеты из кольцевого буфера
+ * и выполняет обмен с адаптером.
+ */
+static void *iothread_main (void *arg)
+{
+    mpsse_adapter_t *a = arg;
+    unsigned tail = a->ring_tail;
+    int nbytes, reply;
+
+    for (;;) {
+        ring_wait (a, &a->ring_head, tail, &a->consumer_sleeping);
+        nbytes = a->ring [tail % RING_SIZE].nbytes;
+        reply = a->ring [tail % RING_SIZE].reply;
+        if (nbytes < 0)
+            return 0;
+        bulk_send (a, a->ring [tail % RING_SIZE].data, nbytes);
+        if (reply)
+            bulk_read_reply (a);
+        tail++;
+        ring_publish (a, &a->ring_tail, tail, &a->producer_sleeping);
+    }
+}
+
+/*
+ * Постановка пакета в очередь потока ввода-вывода.
+ * Если нужен ответ, дожидаемся выполнения всех пакетов.
+ */
+static void iothread_submit (mpsse_adapter_t *a, unsigned char *data,
+    int nbytes, int reply)
+{
+    unsigned head = a->ring_head, tail;
+
+    /* Ждём свободного места. */
+    while (head - (tail = __atomic_load_n (&a->ring_tail, __ATOMIC_SEQ_CST))
+           >= RING_SIZE)
+        ring_wait (a, &a->ring_tail, tail, &a->producer_sleeping);
+
+    if (nbytes > 0)
+        memcpy (a->ring [head % RING_SIZE].data, data, nbytes);
+    a->ring [head % RING_SIZE].nbytes = nbytes;
+    a->ring [head % RING_SIZE].reply = reply;
+    head++;
+    ring_publish (a, &a->ring_head, head, &a->consumer_sleeping);
+
+    if (reply) {
+        while ((tail = __atomic_load_n (&a->ring_tail, __ATOMIC_SEQ_CST))
+               != head)
+            ring_wait (a, &a->ring_tail, tail, &a->producer_sleeping);
+    }
+}
+
+static void iothread_start (mpsse_adapter_t *a)
+{
+    pthread_mutex_init (&a->ring_lock, 0);
+    pthread_cond_init (&a->ring_cond, 0);
+    if (pthread_create (&a->iothread, 0, iothread_main, a) != 0) {
+        fprintf (stderr, "MPSSE adapter: cannot create I/O thread\n");
+        exit (-1);
+    }
+}
+
+static void iothread_stop (mpsse_adapter_t *a)
+{
+    iothread_submit (a, 0, -1, 0);
+    pthread_join (a->iothread, 0);
+    pthread_cond_destroy (&a->ring_cond);
+    pthread_mutex_destroy (&a->ring_lock);
+}
+#endif
+
+/*
+ * Запись пакета без ответа. При наличии потока ввода-вывода
+ * пакет только ставится в очередь.
+ */
+static void bulk_write (mpsse_adapter_t *a, unsigned char *output, int nbytes)
+{
+#ifdef IOTHREAD
+    iothread_submit (a, output, nbytes, 0);
+#else
+    bulk_send (a, output, nbytes);
+#endif
+}
+
+/*
+ * Если в выходном буфере есть накопленные данные -
+ * отправка их устройству.
+ * Ответ добавляется в конец входного буфера.
+ */
+static void mpsse_flush_output (mpsse_adapter_t *a)
+{
+    int i;
+
+    if (a->bytes_to_write <= 0)
+        return;
+    if (a->bytes_to_read <= 0) {
+        bulk_write (a, a->output, a->bytes_to_write);
+        a->bytes_to_write = 0;
+        return;
+    }
+
+    if (a->input_size < a->bytes_received + a->bytes_to_read + 8) {
+        a->input_size = (a->bytes_received + a->bytes_to_read + 8) * 2;
+        a->input = realloc (a->input, a->input_size);
+        if (! a->input) {
+            fprintf (stderr, "Out of memory\n");
+            exit (-1);
+        }
+    }
+
+    /* Посылаем пакет и получаем ответ. */
+#ifdef IOTHREAD
+    iothread_submit (a, a->output, a->bytes_to_write, 1);
+#else
+    bulk_send (a, a->output, a->bytes_to_write);
+    bulk_read_reply (a);
+#endif
+    a->bytes_to_write = 0;
+    if (debug_level > 1) {
+        fprintf (stderr, "mpsse_flush_output received %d bytes:", a->bytes_to_read);
+        for (i=0; i<a->bytes_to_read; i++)
+            fprintf (stderr, "%c%02x", i ? '-' : ' ',
+                a->input [a->bytes_received + i]);
+        fprintf (stderr, "\n");
+    }
+    a->bytes_received += a->bytes_to_read;
+    a->bytes_to_read = 0;
+}
+
+/*
+ * Шаблоны пакетов MPSSE для сканирования 35-битного регистра
+ * DPACC/APACC и 4-битного регистра команд строятся один раз для
+ * каждого устройства цепочки. TAP переходит из Run-Test/Idle
+ * в Shift-DR (TMS 1-0-0) или Shift-IR (TMS 1-1-0-0), выдаёт биты
+ * для устройств ближе к TDO, данные, биты для устройств ближе к TDI,
+ * и последний бит сопровождается сигналом TMS=1. Остальные
+ * устройства находятся в режиме BYPASS: один бит в DR, единицы в IR.
+ * При передаче подставляются только биты данных.
+ */
+#define SCAN_DR_REPLY   6       /* длина ответа */
+
+/*
+ * Выдача nbits единиц на TDI без чтения.
+ */
+static int scan_pad (unsigned char *p, unsigned nbits)
+{
+    unsigned char *start = p;
+    unsigned nbytes = nbits / 8;
+
+    if (nbytes > 0) {
+        /* 19 - Clock Data Bytes Out LSB First (no Read) */
+        *p++ = WTDI + CLKWNEG + LSB;
+        *p++ = nbytes - 1;
+        *p++ = (nbytes - 1) >> 8;
+        memset (p, 0xff, nbytes);
+        p += nbytes;
+    }
+    if (nbits & 7) {
+        /* 1b - Clock Data Bits Out LSB First (no Read) */
+        *p++ = WTDI + BITMODE + CLKWNEG + LSB;
+        *p++ = (nbits & 7) - 1;
+        *p++ = 0xff;
+    }
+    return p - start;
+}
+
+/*
+ * Построение шаблонов для устройства t. Если устройство в цепочке
+ * одно, бит 34 принимается вместе с переходом в Exit1-DR в разряде 6
+ * последнего байта ответа, иначе отдельно, в разряде 7.
+ */
+static void mpsse_build_templates (mpsse_adapter_t *a, mpsse_tap_t *t)
+{
+    unsigned ir_pre = 0, ir_post = 0, dr_pre = t->index;
+    unsigned dr_post = a->ntaps - 1 - t->index;
+    unsigned char *p;
+    int i, r;
+
+    for (i=0; i<a->ntaps; i++) {
+        if (i < t->index)
+            ir_pre += a->taps[i].irlen;
+        else if (i > t->index)
+            ir_post += a->taps[i].irlen;
+    }
+
+    for (r=0; r<2; r++) {
+        p = t->dr_template [r];
+        *p++ = WTMS + BITMODE + CLKWNEG + LSB;
+        *p++ = 3 - 1;
+        *p++ = 0x01;
+        p += scan_pad (p, dr_pre);
+
+        /* Данные, 32 бита и ещё 2 бита.
+         * 39/19 - Clock Data Bytes (In and) Out LSB First
+         * 3b/1b - Clock Data Bits (In and) Out LSB First */
+        *p++ = r ? (WTDI + RTDO + CLKWNEG + LSB) : (WTDI + CLKWNEG + LSB);
+        *p++ = 4 - 1;
+        *p++ = 0;
+        t->dr_data = p - t->dr_template [r];
+        p += 4;
+        *p++ = r ? (WTDI + RTDO + BITMODE + CLKWNEG + LSB) :
+                   (WTDI + BITMODE + CLKWNEG + LSB);
+        *p++ = 2 - 1;
+        *p++ = 0;
+
+        /* Бит 34.
+         * 6b/4b - Clock Data to TMS Pin (with Read) */
+        if (a->ntaps == 1) {
+            *p++ = r ? (WTMS + RTDO + BITMODE + CLKWNEG + LSB) :
+                       (WTMS + BITMODE + CLKWNEG + LSB);
+            *p++ = 2 - 1;
+            t->dr_high = p - t->dr_template [r];
+            t->dr_high_pos = 7;
+            *p++ = 0x03;
+        } else if (dr_post == 0) {
+            *p++ = r ? (WTMS + RTDO + BITMODE + CLKWNEG + LSB) :
+                       (WTMS + BITMODE + CLKWNEG + LSB);
+            *p++ = 1 - 1;
+            t->dr_high = p - t->dr_template [r];
+            t->dr_high_pos = 7;
+            *p++ = 0x01;
+            *p++ = WTMS + BITMODE + CLKWNEG + LSB;
+            *p++ = 1 - 1;
+            *p++ = 0x01;
+        } else {
+            *p++ = r ? (WTDI + RTDO + BITMODE + CLKWNEG + LSB) :
+                       (WTDI + BITMODE + CLKWNEG + LSB);
+            *p++ = 1 - 1;
+            t->dr_high = p - t->dr_template [r];
+            t->dr_high_pos = 0;
+            *p++ = 0;
+            p += scan_pad (p, dr_post - 1);
+            *p++ = WTMS + BITMODE + CLKWNEG + LSB;
+            *p++ = 2 - 1;
+            *p++ = 0x83;
+        }
+        t->dr_size = p - t->dr_template [r];
+    }
+
+    /* Регистр команд: TMS 1-1-0-0, биты для устройств ближе к TDO,
+     * 4 бита команды, биты для устройств ближе к TDI. */
+    p = t->ir_template;
+    *p++ = WTMS + BITMODE + CLKWNEG + LSB;
+    *p++ = 4 - 1;
+    *p++ = 0x03;
+    p += scan_pad (p, ir_pre);
+    *p++ = WTDI + BITMODE + CLKWNEG + LSB;
+    if (ir_post == 0) {
+        *p++ = 3 - 1;
+        t->ir_data = p - t->ir_template;
+        *p++ = 0;
+        *p++ = WTMS + BITMODE + CLKWNEG + LSB;
+        *p++ = 2 - 1;
+        t->ir_last = p - t->ir_template;
+        *p++ = 0x03;
+    } else {
+        *p++ = 4 - 1;
+        t->ir_data = p - t->ir_template;
+        t->ir_last = -1;
+        *p++ = 0;
+        p += scan_pad (p, ir_post - 1);
+        *p++ = WTMS + BITMODE + CLKWNEG + LSB;
+        *p++ = 2 - 1;
+        *p++ = 0x83;
+    }
+    t->ir_size = p - t->ir_template;
+}
+
+static void mpsse_queue (mpsse_adapter_t *a, unsigned *data, int dp,
+    int reg, unsigned addr);
+
+/*
+ * Сканирование 35-битного регистра DR текущего устройства по шаблону.
+ * При сканировании DPACC/APACC выдаётся результат предыдущего
+ * чтения; если оно отложено, ответ принимается и ставится в очередь.
+ * Сканирования с read_flag сами забирают результат своего чтения,
+ * поэтому отложенное значение они не получают. Запись тоже его
+ * не получает: после ответа WAIT она была бы отброшена, а
+ * повторить её адаптер не может, поэтому перед записью значение
+ * забирается через RDBUFF (см. mpsse_complete_read).
+ */
+static void mpsse_scan_dr (mpsse_adapter_t *a, unsigned long long tdi,
+    int read_flag)
+{
+    mpsse_tap_t *t = a->tap;
+    unsigned char *p;
+    int pending = 0, acc;
+
+    acc = a->ir_tap == t && (a->ir == JTAG_IR_DPACC || a->ir == JTAG_IR_APACC);
+    if (acc)
+        t->used = 1;
+    if (! read_flag && a->pending.tap == t && acc && (tdi & 1)) {
+        pending = 1;
+        read_flag = 1;
+    }
+
+    if (a->bytes_to_write > sizeof (a->output) - t->dr_size ||
+        (read_flag && a->bytes_to_read + 10 > a->max_reply))
+        mpsse_flush_output (a);
+
+    p = a->output + a->bytes_to_write;
+    memcpy (p, t->dr_template [read_flag != 0], t->dr_size);
+    p[t->dr_data] = tdi;
+    p[t->dr_data + 1] = tdi >> 8;
+    p[t->dr_data + 2] = tdi >> 16;
+    p[t->dr_data + 3] = tdi >> 24;
+    p[t->dr_data + 6] = (tdi >> 32) & 3;
+    p[t->dr_high] |= (tdi >> 34 & 1) << t->dr_high_pos;
+    a->bytes_to_write += t->dr_size;
+    if (read_flag)
+        a->bytes_to_read += SCAN_DR_REPLY;
+    if (pending) {
+        a->pending.tap = 0;
+        mpsse_queue (a, a->pending.data, 0, a->pending.reg, a->pending.addr);
+    }
+}
+
+/*
+ * Разбор ответа на сканирование DR по шаблону.
+ * Байты 0-3: биты 0-31; два бита 32-33 приходят в старших
+ * разрядах байта 4; бит 34 - в разряде shift байта 5.
+ */
+static inline unsigned long long scan_dr_reply (const unsigned char *p,
+    int shift)
+{
+    return p[0] | (unsigned) p[1] << 8 | (unsigned) p[2] << 16 |
+        (unsigned long long) p[3] << 24 |
+        (unsigned long long) (p[4] >> 6) << 32 |
+        (unsigned long long) (p[5] >> shift & 1) << 34;
+}
+
+#ifdef __SSE2__
+/*
+ * Разбор двух ответов, лежащих по адресам p и p+6, средствами SSE2.
+ * Каждый ответ загружается в 64-битную половину регистра
+ * (два старших байта - мусор от следующего ответа).
+ * Результат: 32 бита данных в словах 0 и 2, код ACK в битах 0-2.
+ */
+static inline __m128i scan_dr_pair (const unsigned char *p, int shift,
+    __m128i *ack)
+{
+    __m128i x = _mm_unpacklo_epi64 (
+        _mm_loadl_epi64 ((const __m128i*) p),
+        _mm_loadl_epi64 ((const __m128i*) (p + SCAN_DR_REPLY)));
+
+    *ack = _mm_and_si128 (x, _mm_set1_epi64x (7));
+
+    /* Биты 3-31 из байтов 0-3, биты 32-33 из разрядов 38-39,
+     * бит 34 из разряда 40+shift. */
+    return _mm_or_si128 (_mm_or_si128 (
+        _mm_and_si128 (_mm_srli_epi64 (x, 3),
+            _mm_set1_epi64x (0x1fffffff)),
+        _mm_and_si128 (_mm_srli_epi64 (x, 38 - 29),
+            _mm_set1_epi64x (3 << 29))),
+        _mm_and_si128 (_mm_srl_epi64 (x, _mm_cvtsi32_si128 (40 + shift - 31)),
+            _mm_set1_epi64x (1u << 31)));
+}
+#endif
+
+/*
+ * Разбор пачки из n ответов: в массив value заносятся
+ * 32 бита данных, в массив ack - код подтверждения.
+ * При наличии SSE2 ответы обрабатываются по четыре.
+ */
+static void scan_dr_decode (const unsigned char *input, int n, int shift,
+    unsigned *value, unsigned char *ack)
+{
+    unsigned long long reply;
+    int i = 0;
+
+#ifdef __SSE2__
+    /* Загрузка читает 8 байтов на каждый 6-байтный ответ,
+     * поэтому последний ответ всегда разбирается обычным путём. */
+    for (; i+4 < n; i+=4) {
+        const unsigned char *p = input + i*SCAN_DR_REPLY;
+        __m128i v01, v23, a01, a23;
+        unsigned a;
+
+        /* Сдвигаем слова 0 и 2 в младшую половину регистра. */
+        v01 = _mm_shuffle_epi32 (scan_dr_pair (p, shift, &a01),
+            _MM_SHUFFLE (3, 1, 2, 0));
+        v23 = _mm_shuffle_epi32 (scan_dr_pair (p + 2*SCAN_DR_REPLY, shift,
+            &a23),
+            _MM_SHUFFLE (3, 1, 2, 0));
+        _mm_storeu_si128 ((__m128i*) (value + i),
+            _mm_unpacklo_epi64 (v01, v23));
+
+        /* Коды ACK упаковываем в четыре байта. */
+        a01 = _mm_shuffle_epi32 (a01, _MM_SHUFFLE (3, 1, 2, 0));
+        a23 = _mm_shuffle_epi32 (a23, _MM_SHUFFLE (3, 1, 2, 0));
+        a01 = _mm_packs_epi32 (_mm_unpacklo_epi64 (a01, a23), a01);
+        a = _mm_cvtsi128_si32 (_mm_packus_epi16 (a01, a01));
+        ack[i]   = a;
+        ack[i+1] = a >> 8;
+        ack[i+2] = a >> 16;
+        ack[i+3] = a >> 24;
+    }
+#endif
+    for (; i<n; i++) {
+        reply = scan_dr_reply (input + i*SCAN_DR_REPLY, shift);
+        value[i] = reply >> 3;
+        ack[i] = reply & 7;
+    }
+}
+
+/*
+ * Приём ответа на единственное сканирование DR по шаблону.
+ */
+static unsigned long long mpsse_recv_dr (mpsse_adapter_t *a)
+{
+    unsigned long long reply;
+
+    mpsse_flush_output (a);
+    reply = scan_dr_reply (a->input, a->reply_shift);
+    a->bytes_received = 0;
+    return reply;
+}
+
+/*
+ * Протокол SWD. Транзакция: запрос 8 бит от адаптера, такт
+ * переключения, подтверждение 3 бита от процессора, затем 32 бита
+ * данных и бит чётности (для записи - после ещё одного такта
+ * переключения). Направление линии SWDIO переключается сигналом TMS.
+ */
+#define SWD_ACK_OK      1
+#define SWD_ACK_WAIT    2
+#define SWD_ACK_FAULT   4
+#define SWD_MAX_SIZE    32      /* наибольшая длина пакета транзакции */
+#define SWD_REPLY       6       /* длина ответа на чтение */
+
+static void swd_drive (mpsse_adapter_t *a, int on)
+{
+    if (a->swd_drive == on)
+        return;
+    if (a->bytes_to_write > sizeof (a->output) - 3)
+        mpsse_flush_output (a);
+
+    /* 80 - Set Data Bits Low Byte: TMS разрешает выход SWDIO. */
+    a->output [a->bytes_to_write++] = 0x80;
+    a->output [a->bytes_to_write++] = on ? 0x08 : 0;
+    a->output [a->bytes_to_write++] = 0x1b;
+    a->swd_drive = on;
+}
+
+static unsigned swd_parity (unsigned value)
+{
+    value ^= value >> 16;
+    value ^= value >> 8;
+    value ^= value >> 4;
+    value ^= value >> 2;
+    value ^= value >> 1;
+    return value & 1;
+}
+
+/*
+ * Транзакция SWD: чтение или запись регистра DP (ap=0) или AP.
+ * Ответ на чтение - SWD_REPLY байтов: подтверждение в старших
+ * битах первого байта, данные, бит чётности в старшем бите
+ * последнего байта. Подтверждение записи не принимается:
+ * после ответа WAIT или FAULT выставлен залипающий флаг, и его
+ * находит чтение CTRL/STAT в swd_flush().
+ */
+static void swd_transfer (mpsse_adapter_t *a, int ap, int reg,
+    int read_flag, unsigned value)
+{
+    unsigned request;
+
+    a->tap->used = 1;
+    if (a->bytes_to_write > sizeof (a->output) - SWD_MAX_SIZE ||
+        (read_flag && a->bytes_to_read + 10 > a->max_reply))
+        mpsse_flush_output (a);
+
+    /* Start, APnDP, RnW, A[3:2], чётность, stop, park. */
+    request = ap << 1 | (read_flag != 0) << 2 | (reg & 0xC) << 1;
+    request |= 0x81 | swd_parity (request) << 5;
+
+    /* 1b - Clock Data Bits Out LSB First (no Read) */
+    swd_drive (a, 1);
+    a->output [a->bytes_to_write++] = WTDI + BITMODE + CLKWNEG + LSB;
+    a->output [a->bytes_to_write++] = 8 - 1;
+    a->output [a->bytes_to_write++] = request;
+    swd_drive (a, 0);
+
+    if (read_flag) {
+        /* Такт переключения и подтверждение, данные, чётность.
+         * 2b - Clock Data Bits In LSB First
+         * 29 - Clock Data Bytes In LSB First */
+        a->output [a->bytes_to_write++] = RTDO + BITMODE + CLKWNEG + LSB;
+        a->output [a->bytes_to_write++] = 4 - 1;
+        a->output [a->bytes_to_write++] = RTDO + CLKWNEG + LSB;
+        a->output [a->bytes_to_write++] = 4 - 1;
+        a->output [a->bytes_to_write++] = 0;
+        a->output [a->bytes_to_write++] = RTDO + BITMODE + CLKWNEG + LSB;
+        a->output [a->bytes_to_write++] = 0;
+
+        /* Такт переключения; линию снова возьмёт следующий запрос. */
+        a->output [a->bytes_to_write++] = WTDI + BITMODE + CLKWNEG + LSB;
+        a->output [a->bytes_to_write++] = 0;
+        a->output [a->bytes_to_write++] = 0;
+        a->bytes_to_read += SWD_REPLY;
+        return;
+    }
+
+    /* Такт переключения, подтверждение, такт переключения. */
+    a->output [a->bytes_to_write++] = WTDI + BITMODE + CLKWNEG + LSB;
+    a->output [a->bytes_to_write++] = 5 - 1;
+    a->output [a->bytes_to_write++] = 0;
+    swd_drive (a, 1);
+
+    /* Данные и бит чётности.
+     * 19 - Clock Data Bytes Out LSB First (no Read) */
+    a->output [a->bytes_to_write++] = WTDI + CLKWNEG + LSB;
+    a->output [a->bytes_to_write++] = 4 - 1;
+    a->output [a->bytes_to_write++] = 0;
+    a->output [a->bytes_to_write++] = value;
+    a->output [a->bytes_to_write++] = value >> 8;
+    a->output [a->bytes_to_write++] = value >> 16;
+    a->output [a->bytes_to_write++] = value >> 24;
+    a->output [a->bytes_to_write++] = WTDI + BITMODE + CLKWNEG + LSB;
+    a->output [a->bytes_to_write++] = 0;
+    a->output [a->bytes_to_write++] = swd_parity (value);
+}
+
+/*
+ * Разбор ответа SWD на чтение. Возвращает код подтверждения;
+ * при ошибке чётности данных - 0.
+ */
+static unsigned swd_reply (const unsigned char *p, unsigned *value)
+{
+    unsigned ack = p[0] >> 5;
+
+    *value = p[1] | p[2] << 8 | p[3] << 16 | (unsigned) p[4] << 24;
+    if (ack == SWD_ACK_OK && swd_parity (*value) != p[5] >> 7)
+        return 0;
+    return ack;
+}
+
+/*
+ * Выдача последовательности бит на SWDIO: сброс линии и переключение
+ * порта отладки из JTAG в SWD.
+ */
+static void swd_sequence (mpsse_adapter_t *a, const unsigned char *data,
+    int nbytes)
+{
+    swd_drive (a, 1);
+    if (a->bytes_to_write > sizeof (a->output) - 3 - nbytes)
+        mpsse_flush_output (a);
+
+    /* 19 - Clock Data Bytes Out LSB First (no Read) */
+    a->output [a->bytes_to_write++] = WTDI + CLKWNEG + LSB;
+    a->output [a->bytes_to_write++] = nbytes - 1;
+    a->output [a->bytes_to_write++] = 0;
+    memcpy (a->output + a->bytes_to_write, data, nbytes);
+    a->bytes_to_write += nbytes;
+}
+
+/* Сброс линии: не менее 50 единиц, затем такты простоя. */
+static const unsigned char swd_line_reset [] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00,
+};
+
+/* Переход из JTAG в SWD: сброс линии, код 0xE79E, снова сброс линии. */
+static const unsigned char swd_jtag_to_swd [] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x9e, 0xe7,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00,
+};
+
+/*
+ * Загрузка регистра команд JTAG текущего устройства; остальные
+ * устройства цепочки получают команду BYPASS.
+ * Сканирование IR пропускается, если там уже нужное значение.
+ */
+static void mpsse_set_ir (mpsse_adapter_t *a, int ir)
+{
+    mpsse_tap_t *t = a->tap;
+    unsigned char *p;
+
+    if (a->ir == ir && a->ir_tap == t)
+        return;
+    if (a->bytes_to_write > sizeof (a->output) - t->ir_size)
+        mpsse_flush_output (a);
+
+    p = a->output + a->bytes_to_write;
+    memcpy (p, t->ir_template, t->ir_size);
+    if (t->ir_last < 0) {
+        p[t->ir_data] = ir & 15;
+    } else {
+        p[t->ir_data] = ir & 7;
+        p[t->ir_last] |= (ir >> 3 & 1) << 7;
+    }
+    a->bytes_to_write += t->ir_size;
+    a->ir = ir;
+    a->ir_tap = t;
+}
+
+/*
+ * Постановка в очередь отложенного чтения: ответ последнего
+ * сканирования будет занесён по адресу data при вызове mpsse_flush().
+ * Регистр и адрес запоминаются, чтобы при ответе WAIT повторить чтение.
+ */
+#define NO_ADDR (~0u)
+
+static void mpsse_queue (mpsse_adapter_t *a, unsigned *data, int dp,
+    int reg, unsigned addr)
+{
+    if (a->queue_len >= a->queue_size) {
+        a->queue_size = a->queue_size ? a->queue_size * 2 : 256;
+        a->queue = realloc (a->queue, a->queue_size * sizeof (a->queue[0]));
+        a->reply_value = realloc (a->reply_value,
+            a->queue_size * sizeof (a->reply_value[0]));
+        a->reply_ack = realloc (a->reply_ack, a->queue_size);
+        if (! a->queue || ! a->reply_value || ! a->reply_ack) {
+            fprintf (stderr, "Out of memory\n");
+            exit (-1);
+        }
+    }
+    a->queue [a->queue_len].tap = a->tap;
+    a->queue [a->queue_len].data = data;
+    a->queue [a->queue_len].dp = dp;
+    a->queue [a->queue_len].reg = reg;
+    a->queue [a->queue_len].addr = addr;
+    a->queue_len++;
+}
+
+/*
+ * Забываем состояние TAP и копии регистров DP после сброса.
+ */
+static void mpsse_invalidate (mpsse_adapter_t *a)
+{
+    int i;
+
+    a->ir = -1;
+    for (i=0; i<a->ntaps; i++) {
+        a->taps[i].select_valid = 0;
+        a->taps[i].csw_valid = 0;
+        a->taps[i].tar_valid = 0;
+    }
+}
+
+/*
+ * Учёт автоинкремента TAR после nwords обращений к регистру DRW.
+ * Инкремент гарантирован только в пределах 1 кбайта.
+ */
+static void mpsse_tar_advance (mpsse_adapter_t *a, unsigned nwords)
+{
+    unsigned tar;
+
+    if (! a->tap->tar_valid)
+        return;
+    if (! a->tap->csw_valid) {
+        a->tap->tar_valid = 0;
+        return;
+    }
+    switch (a->tap->csw & CSW_ADDRINC_MASK) {
+    case CSW_ADDRINC_OFF:
+        return;
+    case CSW_ADDRINC_SINGLE:
+        tar = a->tap->tar + nwords * (1 << (a->tap->csw & 3));
+        if ((tar ^ a->tap->tar) & ~0x3FF)
+            a->tap->tar_valid = 0;
+        else
+            a->tap->tar = tar;
+        return;
+    default:
+        a->tap->tar_valid = 0;
+        return;
+    }
+}
+
+/*
+ * Можно ли повторить отвергнутое чтение. Регистры BD0-BD3 отображают
+ * регистры периферии (например, EEPROM_DO), значение которых зависит
+ * от предшествующих записей; чтение DRW без известного адреса
+ * попало бы по текущему TAR. Такие чтения не повторяются.
+ */
+static int mpsse_can_retry (int dp, int reg, unsigned addr)
+{
+    if (dp)
+        return 1;
+    if ((reg & 0xF0) == MEM_AP_BD0)
+        return 0;
+    return reg != MEM_AP_DRW || addr != NO_ADDR;
+}
+
+static int mpsse_retry (mpsse_adapter_t *a, unsigned *data, int dp,
+    int reg, unsigned addr);
+static void mpsse_clear_sticky (mpsse_adapter_t *a);
+static void mpsse_complete_read (mpsse_adapter_t *a);
+static void mpsse_idle (mpsse_adapter_t *a, unsigned long long nclk);
+
+/*
+ * Выполнение накопленных транзакций и разбор ответов
+ * на отложенные чтения.
+ *
+ * Обнаружение переполнения (CORUNDETECT) включено постоянно: после
+ * ответа WAIT транзакция отбрасывается, выставляется SSTICKYORUN,
+ * и все следующие транзакции этого устройства игнорируются. Ответы
+ * на записи не принимаются, поэтому в конце пакета у каждого
+ * устройства, с которым шёл обмен, читается CTRL/STAT.
+ * При сбое флаги сбрасываются. Если в пакете были записи в память,
+ * адаптер не может их повторить: выставляется stalled, и
+ * последовательность повторяет вызывающая сторона. Иначе все чтения
+ * устройства из пакета выполняются заново, по одному.
+ */
+static void mpsse_flush (adapter_t *adapter)
+{
+    mpsse_adapter_t *a = mpsse_tap (adapter);
+    mpsse_tap_t *t;
+    unsigned ack;
+    int i, n;
+
+    mpsse_complete_read (a);
+    for (i=0; i<a->ntaps; i++) {
+        t = &a->taps[i];
+        t->failed = 0;
+        if (! t->used)
+            continue;
+
+        /* Такты простоя, чтобы последняя транзакция AP завершилась. */
+        a->tap = t;
+        mpsse_idle (a, 8);
+        t->stat = 0;
+        mpsse_set_ir (a, JTAG_IR_DPACC);
+        mpsse_scan_dr (a, (DP_CTRL_STAT >> 1) | 1, 0);
+        mpsse_scan_dr (a, (DP_RDBUFF >> 1) | 1, 1);
+        mpsse_queue (a, &t->stat, 1, DP_CTRL_STAT, NO_ADDR);
+    }
+    mpsse_flush_output (a);
+    scan_dr_decode (a->input, a->queue_len, a->reply_shift,
+        a->reply_value, a->reply_ack);
+    for (i=0; i<a->queue_len; i++) {
+        /* Предыдущая транзакция MEM-AP могла завершиться неуспешно.
+         * Анализируем ответ WAIT. */
+        t = a->queue[i].tap;
+        ack = a->reply_ack[i];
+        if (ack != 2 && ! (a->queue[i].dp && ack == 1)) {
+            if (debug_level > 1)
+                fprintf (stderr, "read <<<WAIT>>>\n");
+            t->adapter.stat_wait++;
+            t->failed = 1;
+            continue;
+        }
+        *a->queue[i].data = a->reply_value[i];
+    }
+    n = a->queue_len;
+    a->queue_len = 0;
+    a->bytes_received = 0;
+
+    /* Сбрасываем флаги у устройств, пакет которых не прошёл.
+     * Записи TAR, CSW и DP_SELECT могли быть отброшены. */
+    for (i=0; i<a->ntaps; i++) {
+        t = &a->taps[i];
+        if (t->used && (t->stat & (SSTICKYORUN | SSTICKYERR)))
+            t->failed = 1;
+        if (! t->failed)
+            continue;
+        a->tap = t;
+        mpsse_clear_sticky (a);
+        t->select_valid = 0;
+        t->csw_valid = 0;
+        t->tar_valid = 0;
+        if (t->wrote) {
+            if (debug_level)
+                fprintf (stderr, "writes dropped, CTRL/STAT = %08x\n", t->stat);
+            t->lost = 1;
+        }
+    }
+
+    /* Чтения устройств со сбоем выполняем заново. */
+    for (i=0; i<n; i++) {
+        t = a->queue[i].tap;
+        if (! t->failed || a->queue[i].data == &t->stat)
+            continue;
+        if (t->wrote || ! mpsse_can_retry (a->queue[i].dp,
+            a->queue[i].reg, a->queue[i].addr)) {
+            t->lost = 1;
+            continue;
+        }
+        a->tap = t;
+        if (! mpsse_retry (a, a->queue[i].data, a->queue[i].dp,
+            a->queue[i].reg, a->queue[i].addr))
+            t->lost = 1;
+    }
+    for (i=0; i<a->ntaps; i++) {
+        a->taps[i].used = 0;
+        a->taps[i].wrote = 0;
+    }
+
+    /* Сбои других устройств цепочки сообщаются
+     * при их собственном вызове flush(). */
+    t = (mpsse_tap_t*) adapter;
+    a->tap = t;
+    adapter->stalled = t->lost;
+    t->lost = 0;
+}
+
+static void mpsse_reset (mpsse_adapter_t *a, int trst, int sysrst, int led)
+{
+    unsigned char output [3];
+    unsigned low_output = 0x08; /* TCK idle high */
+    unsigned low_direction = 0x1b;
+    unsigned high_direction = 0x0f;
+    unsigned high_output = 0;
+
+    /* command "set data bits low byte" */
+    output [0] = 0x80;
+    output [1] = low_output;
+    output [2] = low_direction;
+    bulk_write (a, output, 3);
+
+    /* В режиме SWD сигнал /TRST включает переходник. */
+    if (! trst && ! a->swd)
+        high_output |= 1;
+
+    if (sysrst)
+        high_output |= 2;
+
+    if (led)
+        high_output |= 8;
+
+    /* command "set data bits high byte" */
+    output [0] = 0x82;
+    output [1] = high_output;
+    output [2] = high_direction;
+
+    bulk_write (a, output, 3);
+
+    /* TMS=1: в режиме SWD выход SWDIO разрешён. */
+    a->swd_drive = 1;
+    if (debug_level)
+        fprintf (stderr, "mpsse_reset (trst=%d, sysrst=%d) high_output=0x%2.2x, high_direction: 0x%2.2x\n",
+            trst, sysrst, high_output, high_direction);
+}
+
+/*
+ * Опорная частота делителя TCK, в килогерцах.
+ * FT2232D: 12 МГц / 2; FT2232H с отключённым делителем на 5: 60 МГц / 2.
+ */
+static unsigned mpsse_base_khz (mpsse_adapter_t *a)
+{
+    return a->ft2232h ? 30000 : 6000;
+}
+
+/*
+ * Вычисление делителя для частоты TCK не выше заданной.
+ */
+static unsigned mpsse_divisor (mpsse_adapter_t *a, unsigned khz)
+{
+    unsigned divisor;
+
+    divisor = (mpsse_base_khz (a) + khz - 1) / khz;
+    if (divisor > 0)
+        divisor--;
+    if (divisor > 0xffff)
+        divisor = 0xffff;
+    return divisor;
+}
+
+static void mpsse_speed (mpsse_adapter_t *a, int divisor)
+{
+    unsigned char output [3];
+    int i;
+
+    /* command "set TCK divisor" */
+    output [0] = 0x86;
+    output [1] = divisor;
+    output [2] = divisor >> 8;
+    bulk_write (a, output, 3);
+    a->tck_khz = mpsse_base_khz (a) / (divisor + 1);
+    for (i=0; i<MAX_TAPS; i++)
+        a->taps[i].adapter.tck_khz = a->tck_khz;
+}
+
+/*
+ * Настройка частоты TCK и таймера задержки FTDI.
+ * Возвращает фактическую частоту в кГц или 0 при ошибке.
+ */
+static unsigned mpsse_set_clock (adapter_t *adapter, unsigned khz,
+    unsigned latency)
+{
+    mpsse_adapter_t *a = mpsse_tap (adapter);
+
+    adapter->flush (adapter);
+    if (ftdi_control (a, 0, SIO_SET_LATENCY_TIMER, latency, 0, 0) != 0)
+        return 0;
+    a->latency = latency;
+    mpsse_speed (a, mpsse_divisor (a, khz));
+    return a->tck_khz;
+}
+
+/*
+ * Файл профилей адаптеров: в каждой строке серийный номер,
+ * частота TCK в кГц и значение таймера задержки.
+ */
+static const char *profile_path (void)
+{
+    static char path [256];
+    const char *home;
+
+    home = getenv ("HOME");
+    if (! home)
+        home = getenv ("USERPROFILE");
+    if (! home)
+        return 0;
+    snprintf (path, sizeof (path), "%s/.milprog-profile", home);
+    return path;
+}
+
+/*
+ * Поиск сохранённого профиля для данного адаптера.
+ */
+static int profile_load (mpsse_adapter_t *a, unsigned *khz, unsigned *latency)
+{
+    const char *path = profile_path ();
+    char line [128], serial [64];
+    unsigned k, l;
+    int found = 0;
+    FILE *fd;
+
+    if (! path)
+        return 0;
+    fd = fopen (path, "r");
+    if (! fd)
+        return 0;
+    while (fgets (line, sizeof (line), fd)) {
+        if (sscanf (line, "%63s %u %u", serial, &k, &l) == 3 &&
+            strcmp (serial, a->serial) == 0 && k > 0) {
+            *khz = k;
+            *latency = l;
+            found = 1;
+        }
+    }
+    fclose (fd);
+    return found;
+}
+
+/*
+ * Сохранение текущих частоты TCK и таймера задержки в профиле.
+ * Строки других адаптеров переписываются без изменений.
+ */
+static void mpsse_save_profile (adapter_t *adapter)
+{
+    mpsse_adapter_t *a = mpsse_tap (adapter);
+    const char *path = profile_path ();
+    char line [128], serial [64], *text = 0;
+    int len = 0, n;
+    FILE *fd;
+
+    if (! path)
+        return;
+    fd = fopen (path, "r");
+    if (fd) {
+        while (fgets (line, sizeof (line), fd)) {
+            if (sscanf (line, "%63s", serial) == 1 &&
+                strcmp (serial, a->serial) == 0)
+                continue;
+            n = strlen (line);
+            text = realloc (text, len + n + 1);
+            if (! text) {
+                fprintf (stderr, "Out of memory\n");
+                exit (-1);
+            }
+            strcpy (text + len, line);
+            len += n;
+        }
+        fclose (fd);
+    }
+    fd = fopen (path, "w");
+    if (! fd) {
+        perror (path);
+        free (text);
+        return;
+    }
+    if (text)
+        fputs (text, fd);
+    fprintf (fd, "%s %u %u\n", a->serial, a->tck_khz, a->latency);
+    fclose (fd);
+    free (text);
+}
+
+/*
+ * Адаптер общий для всех устройств цепочки:
+ * открывается при первом обращении, закрывается вместе
+ * с последним экземпляром adapter_t.
+ */
+static mpsse_adapter_t *mpsse_device;
+
+static void mpsse_close_device (mpsse_adapter_t *a)
+{
+    mpsse_reset (a, 0, 0, 0);
+#ifdef IOTHREAD
+    iothread_stop (a);
+#endif
+    usb_close_adapter (a);
+    free (a->input);
+    free (a->queue);
+    free (a->reply_value);
+    free (a->reply_ack);
+    free (a);
+    if (mpsse_device == a)
+        mpsse_device = 0;
+}
+
+static void mpsse_close (adapter_t *adapter)
+{
+    mpsse_adapter_t *a = mpsse_tap (adapter);
+
+    adapter->flush (adapter);
+    adapter->close = 0;
+    if (--a->nopen > 0)
+        return;
+    mpsse_close_device (a);
+}
+
+/*
+ * Выборка n бит (не более 32) из принятого потока, начиная с бита pos.
+ */
+static unsigned scan_bits (const unsigned char *p, unsigned pos, unsigned n)
+{
+    unsigned long long word = 0;
+    int i;
+
+    for (i=(pos+n-1)/8; i>=(int)(pos/8); i--)
+        word = word << 8 | p[i];
+    word >>= pos & 7;
+    return n < 32 ? (word & ((1u << n) - 1)) : (unsigned) word;
+}
+
+/*
+ * Чтение идентификаторов всех устройств цепочки.
+ * После сброса TAP в регистре DR каждого устройства выбран IDCODE
+ * (32 бита, младший бит 1) или BYPASS (один нулевой бит).
+ * Сдвигаем единицы, пока на выходе не появятся 32 единицы подряд.
+ * Возвращаем число устройств или -1 при ошибке.
+ */
+#define CHAIN_DR_BYTES  (MAX_TAPS*4 + 4)
+
+static int mpsse_read_chain (mpsse_adapter_t *a, unsigned idcode [MAX_TAPS])
+{
+    unsigned char *p;
+    unsigned pos, word;
+    int n;
+
+    mpsse_flush_output (a);
+    a->bytes_received = 0;
+    p = a->output;
+
+    /* Test-Logic-Reset, Run-Test/Idle, затем Shift-DR:
+     * TMS 1-1-1-1-1-0, 1-0-0. */
+    *p++ = WTMS + BITMODE + CLKWNEG + LSB;
+    *p++ = 6 - 1;
+    *p++ = 0x1f;
+    *p++ = WTMS + BITMODE + CLKWNEG + LSB;
+    *p++ = 3 - 1;
+    *p++ = 0x01;
+
+    /* 39 - Clock Data Bytes In and Out LSB First */
+    *p++ = WTDI + RTDO + CLKWNEG + LSB;
+    *p++ = CHAIN_DR_BYTES - 1;
+    *p++ = 0;
+    memset (p, 0xff, CHAIN_DR_BYTES);
+    p += CHAIN_DR_BYTES;
+
+    /* Exit1-DR, Update-DR, Run-Test/Idle: TMS 1-1-0. */
+    *p++ = WTMS + BITMODE + CLKWNEG + LSB;
+    *p++ = 3 - 1;
+    *p++ = 0x83;
+
+    a->bytes_to_write = p - a->output;
+    a->bytes_to_read = CHAIN_DR_BYTES;
+    mpsse_flush_output (a);
+    a->bytes_received = 0;
+    a->ir = -1;
+
+    n = 0;
+    for (pos=0; pos + 32 <= CHAIN_DR_BYTES*8; ) {
+        if (! (a->input [pos/8] >> (pos & 7) & 1)) {
+            /* BYPASS. */
+            word = 0;
+            pos++;
+        } else {
+            word = scan_bits (a->input, pos, 32);
+            if (word == 0xffffffff)
+                return n;
+            pos += 32;
+        }
+        if (n >= MAX_TAPS)
+            break;
+        idcode [n++] = word;
+    }
+    fprintf (stderr, "MPSSE adapter: more than %d devices in JTAG chain\n",
+        MAX_TAPS);
+    return -1;
+}
+
+/*
+ * Суммарная длина регистров команд цепочки. В Shift-IR сдвигаем
+ * нули, заполняя ими цепочку, затем единицы, считая выходящие нули.
+ * В регистрах всех устройств остаётся команда BYPASS.
+ */
+#define CHAIN_IR_BYTES  (MAX_TAPS*4)
+
+static int mpsse_read_irlen (mpsse_adapter_t *a)
+{
+    unsigned char *p;
+    int nbits;
+
+    mpsse_flush_output (a);
+    a->bytes_received = 0;
+    p = a->output;
+
+    /* Run-Test/Idle -> Shift-IR: TMS 1-1-0-0. */
+    *p++ = WTMS + BITMODE + CLKWNEG + LSB;
+    *p++ = 4 - 1;
+    *p++ = 0x03;
+
+    /* 19 - Clock Data Bytes Out LSB First (no Read) */
+    *p++ = WTDI + CLKWNEG + LSB;
+    *p++ = CHAIN_IR_BYTES - 1;
+    *p++ = 0;
+    memset (p, 0, CHAIN_IR_BYTES);
+    p += CHAIN_IR_BYTES;
+
+    /* 39 - Clock Data Bytes In and Out LSB First */
+    *p++ = WTDI + RTDO + CLKWNEG + LSB;
+    *p++ = CHAIN_IR_BYTES - 1;
+    *p++ = 0;
+    memset (p, 0xff, CHAIN_IR_BYTES);
+    p += CHAIN_IR_BYTES;
+
+    /* Exit1-IR, Update-IR, Run-Test/Idle: TMS 1-1-0. */
+    *p++ = WTMS + BITMODE + CLKWNEG + LSB;
+    *p++ = 3 - 1;
+    *p++ = 0x83;
+
+    a->bytes_to_write = p - a->output;
+    a->bytes_to_read = CHAIN_IR_BYTES;
+    mpsse_flush_output (a);
+    a->bytes_received = 0;
+    a->ir = -1;
+
+    for (nbits=0; nbits < CHAIN_IR_BYTES*8; nbits++)
+        if (a->input [nbits/8] >> (nbits & 7) & 1)
+            return nbits;
+    return -1;
+}
+
+/*
+ * Устройство с JTAG-DP фирмы ARM: длина IR 4 бита.
+ */
+#define IS_ARM_DP(id)   (((id) & 0x0fffffff) == (IDCODE_JTAG_DP & 0x0fffffff))
+
+/*
+ * Определение устройств цепочки и длин их регистров команд.
+ * Длина IR известна для ARM JTAG-DP; длину одного неизвестного
+ * устройства вычисляем из суммарной, иначе она должна быть задана
+ * опцией --chain.
+ */
+static int mpsse_scan_chain (mpsse_adapter_t *a)
+{
+    unsigned idcode [MAX_TAPS];
+    int i, n, total, known = 0, unknown = -1;
+
+    n = mpsse_read_chain (a, idcode);
+    if (n < 0)
+        return 0;
+    if (n == 0) {
+        fprintf (stderr, "MPSSE adapter: no devices in JTAG chain\n");
+        return 0;
+    }
+    total = mpsse_read_irlen (a);
+    if (total < 2*n) {
+        fprintf (stderr, "MPSSE adapter: bad IR length of JTAG chain\n");
+        return 0;
+    }
+    if (adapter_chain_len > 0) {
+        if (adapter_chain_len != n) {
+            fprintf (stderr, "MPSSE adapter: %d devices in JTAG chain, %d given by --chain\n",
+                n, adapter_chain_len);
+            return 0;
+        }
+        for (i=0; i<n; i++) {
+            a->taps[i].irlen = adapter_irlen[i];
+            known += adapter_irlen[i];
+        }
+    } else {
+        for (i=0; i<n; i++) {
+            if (IS_ARM_DP (idcode[i])) {
+                a->taps[i].irlen = 4;
+                known += 4;
+            } else if (unknown < 0) {
+                unknown = i;
+            } else {
+                fprintf (stderr, "MPSSE adapter: unknown IR lengths, use --chain option\n");
+                return 0;
+            }
+        }
+        if (unknown >= 0 && total - known >= 2) {
+            a->taps[unknown].irlen = total - known;
+            known = total;
+        }
+    }
+    if (known != total) {
+        fprintf (stderr, "MPSSE adapter: IR length of JTAG chain is %d, expected %d\n",
+            total, known);
+        return 0;
+    }
+
+    a->ntaps = n;
+    for (i=0; i<n; i++) {
+        mpsse_tap_t *t = &a->taps[i];
+
+        t->dev = a;
+        t->index = i;
+        t->adapter.ntaps = n;
+        t->adapter.tap = i;
+        memcpy (t->adapter.chain, idcode, sizeof (idcode));
+        if (debug_level)
+            fprintf (stderr, "MPSSE: TAP %d: idcode %08x, IR %d bits\n",
+                i, idcode[i], t->irlen);
+    }
+    a->reply_shift = (n == 1) ? 6 : 7;
+    for (i=0; i<n; i++) {
+        if (a->taps[i].irlen == 4)
+            mpsse_build_templates (a, &a->taps[i]);
+    }
+    return 1;
+}
+
+/*
+ * Read the Device Identification code
+ */
+static unsigned mpsse_get_idcode (adapter_t *adapter)
+{
+    mpsse_adapter_t *a = mpsse_tap (adapter);
+    unsigned idcode [MAX_TAPS];
+    int n;
+
+    /* Выполняем отложенные чтения. */
+    mpsse_flush (adapter);
+
+    /* Reset the JTAG TAP controller. After reset, the IDCODE
+     * register is always selected in every device of the chain. */
+    n = mpsse_read_chain (a, idcode);
+    mpsse_invalidate (a);
+    if (n <= a->tap->index)
+        return 0;
+    return idcode [a->tap->index];
+}
+
+/*
+ * Учёт записи регистра DP (ap=0) или MEM-AP (ap=1) в копиях
+ * DP_SELECT, CSW и TAR. Возвращает 0, если там уже это значение
+ * и запись можно пропустить.
+ */
+static int mpsse_shadow (mpsse_adapter_t *a, int ap, int reg, unsigned value)
+{
+    if (! ap && reg == DP_SELECT) {
+        if (a->tap->select_valid && a->tap->select == value)
+            return 0;
+        a->tap->select = value;
+        a->tap->select_valid = 1;
+    }
+    if (! ap && reg == DP_CTRL_STAT && (value & (SSTICKYERR | SSTICKYORUN))) {
+        /* Сброс ошибки: транзакции, изменявшие TAR, могли не пройти. */
+        a->tap->tar_valid = 0;
+    }
+    if (ap && reg == MEM_AP_TAR) {
+        if (a->tap->tar_valid && a->tap->tar == value)
+            return 0;
+        a->tap->tar = value;
+        a->tap->tar_valid = 1;
+    }
+    if (ap && reg == MEM_AP_CSW) {
+        if (a->tap->csw_valid && a->tap->csw == value)
+            return 0;
+        a->tap->csw = value;
+        a->tap->csw_valid = 1;
+    }
+    return 1;
+}
+
+/*
+ * Запись регистра DP.
+ * Повторная запись того же значения в DP_SELECT пропускается.
+ */
+static void mpsse_dp_write (adapter_t *adapter, int reg, unsigned value)
+{
+    mpsse_adapter_t *a = mpsse_tap (adapter);
+
+    if (! mpsse_shadow (a, 0, reg, value))
+        return;
+    if (a->pending.tap == a->tap)
+        mpsse_complete_read (a);
+    mpsse_set_ir (a, JTAG_IR_DPACC);
+    mpsse_scan_dr (a, (reg >> 1) |
+        (unsigned long long) value << 3, 0);
+    if (debug_level > 1) {
+        fprintf (stderr, "DP write %08x to %s (%02x)\n", value,
+            DP_REGNAME(reg), reg);
+    }
+}
+
+/*
+ * Отложенное чтение регистра DP.
+ */
+static void mpsse_dp_queue_read (adapter_t *adapter, int reg, unsigned *data)
+{
+    mpsse_adapter_t *a = mpsse_tap (adapter);
+
+    mpsse_set_ir (a, JTAG_IR_DPACC);
+    mpsse_scan_dr (a, (reg >> 1) | 1, 0);
+    mpsse_scan_dr (a, (DP_RDBUFF >> 1) | 1, 1);
+    mpsse_queue (a, data, 1, reg, NO_ADDR);
+}
+
+/*
+ * Чтение регистра DP.
+ */
+static unsigned mpsse_dp_read (adapter_t *adapter, int reg)
+{
+    unsigned value;
+
+    adapter->dp_queue_read (adapter, reg, &value);
+    adapter->flush (adapter);
+    if (debug_level > 1) {
+        fprintf (stderr, "DP read %08x from %s (%02x)\n", value,
+            DP_REGNAME(reg), reg);
+    }
+    return value;
+}
+
+/*
+ * Выбор банка регистров MEM-AP: старшие биты адреса заносятся
+ * в регистр DP_SELECT, если там другое значение.
+ */
+static void mpsse_select_bank (mpsse_adapter_t *a, int reg)
+{
+    a->tap->adapter.dp_write (&a->tap->adapter, DP_SELECT, reg & 0xF0);
+}
+
+/*
+ * Запись регистра MEM-AP.
+ * Повторная запись того же значения в CSW или TAR пропускается.
+ */
+static void mpsse_mem_ap_write (adapter_t *adapter, int reg, unsigned value)
+{
+    mpsse_adapter_t *a = mpsse_tap (adapter);
+
+    mpsse_select_bank (a, reg);
+    if (! mpsse_shadow (a, 1, reg, value))
+        return;
+    if (a->pending.tap == a->tap)
+        mpsse_complete_read (a);
+
+    /* Пишем в регистр MEM-AP. */
+    mpsse_set_ir (a, JTAG_IR_APACC);
+    mpsse_scan_dr (a, (reg >> 1 & 6) |
+        (unsigned long long) value << 3, 0);
+    if (reg == MEM_AP_DRW || (reg & 0xF0) == MEM_AP_BD0)
+        a->tap->wrote = 1;
+    if (reg == MEM_AP_DRW)
+        mpsse_tar_advance (a, 1);
+    if (debug_level > 1) {
+        fprintf (stderr, "MEM-AP write %08x to %s (%02x)\n", value,
+            MEM_AP_REGNAME(reg), reg);
+    }
 }
 
 /*
- * Если в выходном буфере есть накопленные данные -
- * отправка их устройству.
+ * Отложенное чтение регистра MEM-AP.
  */
-static void mpsse_flush_output (mpsse_adapter_t *a)
+static void mpsse_mem_ap_queue_read (adapter_t *adapter, int reg, unsigned *data)
 {
-    int bytes_read, n;
-    unsigned char reply [64];
+    mpsse_adapter_t *a = mpsse_tap (adapter);
+    unsigned addr;
 
-    if (a->bytes_to_write <= 0)
-        return;
+    /* Место для отложенного чтения одно на всю цепочку: чтение
+     * другого устройства сначала завершаем через его RDBUFF. */
+    if (a->pending.tap && a->pending.tap != a->tap)
+        mpsse_complete_read (a);
 
-    bulk_write (a, a->output, a->bytes_to_write);
-    a->bytes_to_write = 0;
-    if (a->bytes_to_read <= 0)
+    /* Читаем содержимое регистра MEM-AP. */
+    mpsse_select_bank (a, reg);
+    mpsse_set_ir (a, JTAG_IR_APACC);
+    mpsse_scan_dr (a, (reg >> 1 & 6) | 1, 0);
+    addr = (reg == MEM_AP_DRW && a->tap->tar_valid) ? a->tap->tar : NO_ADDR;
+    if (reg == MEM_AP_DRW)
+        mpsse_tar_advance (a, 1);
+
+    /* Значение придёт при следующем чтении регистра DP или AP,
+     * которое и так последует, так что отдельное чтение RDBUFF
+     * нужно только перед записью. */
+    a->pending.tap = a->tap;
+    a->pending.data = data;
+    a->pending.reg = reg;
+    a->pending.addr = addr;
+}
+
+/*
+ * Отложенное чтение MEM-AP, не получившее значения:
+ * забираем его из регистра RDBUFF.
+ */
+static void mpsse_complete_read (mpsse_adapter_t *a)
+{
+    mpsse_tap_t *t = a->tap;
+
+    if (! a->pending.tap)
         return;
+    a->tap = a->pending.tap;
+    mpsse_set_ir (a, JTAG_IR_DPACC);
+    mpsse_scan_dr (a, (DP_RDBUFF >> 1) | 1, 0);
+    a->tap = t;
+}
 
-    /* Получаем ответ. */
-    bytes_read = 0;
-    while (bytes_read < a->bytes_to_read) {
-        n = usb_bulk_read (a->usbdev, OUT_EP, (char*) reply,
-            a->bytes_to_read - bytes_read + 2, 2000);
-        if (n < 0) {
-            fprintf (stderr, "usb bulk read failed\n");
-            exit (-1);
-        }
-        if (debug_level > 1) {
-            if (n != a->bytes_to_read + 2)
-                fprintf (stderr, "usb bulk read %d bytes of %d\n",
-                    n, a->bytes_to_read - bytes_read + 2);
-            else {
-                int i;
-                fprintf (stderr, "usb bulk read %d bytes:", n);
-                for (i=0; i<n; i++)
-                    fprintf (stderr, "%c%02x", i ? '-' : ' ', reply[i]);
-                fprintf (stderr, "\n");
-            }
-        }
-        if (n > 2) {
-            /* Copy data. */
-            memcpy (a->input + bytes_read, reply + 2, n - 2);
-            bytes_read += n - 2;
-        }
-    }
+/*
+ * Чтение регистра MEM-AP.
+ */
+static unsigned mpsse_mem_ap_read (adapter_t *adapter, int reg)
+{
+    unsigned value;
+
+    adapter->mem_ap_queue_read (adapter, reg, &value);
+    adapter->flush (adapter);
     if (debug_level > 1) {
-        int i;
-        fprintf (stderr, "mpsse_flush_output received %d bytes:", a->bytes_to_read);
-        for (i=0; i<a->bytes_to_read; i++)
-            fprintf (stderr, "%c%02x", i ? '-' : ' ', a->input[i]);
-        fprintf (stderr, "\n");
+        fprintf (stderr, "MEM-AP read %08x from %s (%02x)\n", value,
+            MEM_AP_REGNAME(reg), reg);
     }
-    a->bytes_to_read = 0;
+    return value;
 }
 
-static void mpsse_send (mpsse_adapter_t *a,
-    unsigned tms_prolog_nbits, unsigned tms_prolog,
-    unsigned tdi_nbits, unsigned long long tdi, int read_flag)
+/*
+ * Чтение блока памяти.
+ * Количество слов не ограничено: блок разбивается на части по границам
+ * 1 кбайта, за которыми автоинкремент TAR не гарантирован.
+ */
+static void mpsse_read_data (adapter_t *adapter,
+    unsigned addr, unsigned nwords, unsigned *data)
 {
-    unsigned tms_epilog_nbits = 0, tms_epilog = 0;
+    mpsse_adapter_t *a = mpsse_tap (adapter);
+    unsigned i, n;
+
+    for (; nwords > 0; nwords -= n, addr += n*4, data += n) {
+        n = (0x400 - (addr & 0x3FF)) / 4;
+        if (n > nwords)
+            n = nwords;
+
+        /* Пишем адрес в регистр TAR. */
+        mpsse_mem_ap_write (adapter, MEM_AP_TAR, addr);
+
+        /* Запрашиваем данные через регистр DRW.
+         * Каждое чтение выдаёт значение предыдущего. */
+        mpsse_set_ir (a, JTAG_IR_APACC);
+        mpsse_scan_dr (a, (MEM_AP_DRW >> 1 & 6) | 1, 0);
+        for (i=1; i<n; i++) {
+            mpsse_set_ir (a, JTAG_IR_APACC);
+            mpsse_scan_dr (a, (MEM_AP_DRW >> 1 & 6) | 1, 1);
+            mpsse_queue (a, data + i-1, 0, MEM_AP_DRW, addr + (i-1)*4);
+        }
 
-    if (tdi_nbits > 0) {
-        /* Если есть данные, добавляем:
-         * стандартный пролог TMS 1-0-0,
-         * стандартный эпилог TMS 1. */
-        tms_prolog |= 1 << tms_prolog_nbits;
-        tms_prolog_nbits += 3;
-        tms_epilog = 1;
-        tms_epilog_nbits = 1;
+        /* Последнее значение забираем из RDBUFF, чтобы
+         * не читать лишнее слово за концом блока. */
+        mpsse_set_ir (a, JTAG_IR_DPACC);
+        mpsse_scan_dr (a, (DP_RDBUFF >> 1) | 1, 1);
+        mpsse_queue (a, data + n-1, 0, MEM_AP_DRW, addr + (n-1)*4);
+        mpsse_tar_advance (a, n);
     }
-    /* Проверяем, есть ли место в выходном буфере.
-     * Максимальный размер одного пакета - 23 байта (6+8+3+3+3). */
-    if (a->bytes_to_write > sizeof (a->output) - 23)
+
+    /* Шлём пакет и извлекаем данные. */
+    mpsse_flush (adapter);
+}
+
+/*
+ * Выдача nclk тактов простоя. В режиме SWD линия SWDIO
+ * удерживается в нуле, а TMS не трогаем: это разрешение выхода.
+ */
+static void mpsse_idle (mpsse_adapter_t *a, unsigned long long nclk)
+{
+    /* 4b - Clock Data to TMS Pin (no Read)
+     * 1b - Clock Data Bits Out LSB First (no Read) */
+    unsigned char cmd = a->swd ? (WTDI + BITMODE + CLKWNEG + LSB) :
+                                 (WTMS + BITMODE + CLKWNEG + LSB);
+    unsigned n;
+
+    if (a->swd)
+        swd_drive (a, 1);
+    if (a->bytes_to_write > sizeof (a->output) - 6)
         mpsse_flush_output (a);
 
-    /* Формируем пакет команд MPSSE. */
-    if (tms_prolog_nbits > 0) {
-        /* Пролог TMS, от 1 до 14 бит.
-         * 4b - Clock Data to TMS Pin (no Read) */
-        a->output [a->bytes_to_write++] = WTMS + BITMODE + CLKWNEG + LSB;
-        if (tms_prolog_nbits < 8) {
-            a->output [a->bytes_to_write++] = tms_prolog_nbits - 1;
-            a->output [a->bytes_to_write++] = tms_prolog;
+    /* Переход в Run-Test/Idle: первый такт с TMS=0 (TDI=0). */
+    a->output [a->bytes_to_write++] = cmd;
+    a->output [a->bytes_to_write++] = 0;
+    a->output [a->bytes_to_write++] = 0;
+    nclk--;
+
+    while (nclk >= 8) {
+        n = nclk / 8;
+        if (n > 0x10000)
+            n = 0x10000;
+        if (a->ft2232h) {
+            /* 8f - Clock For n x 8 bits with no data transfer */
+            if (a->bytes_to_write > sizeof (a->output) - 3)
+                mpsse_flush_output (a);
+            a->output [a->bytes_to_write++] = 0x8f;
         } else {
-            a->output [a->bytes_to_write++] = 7 - 1;
-            a->output [a->bytes_to_write++] = tms_prolog & 0x7f;
-            a->output [a->bytes_to_write++] = WTMS + BITMODE + CLKWNEG + LSB;
-            a->output [a->bytes_to_write++] = tms_prolog_nbits - 7 - 1;
-            a->output [a->bytes_to_write++] = tms_prolog >> 7;
-        }
-    }
-    if (tdi_nbits > 0) {
-        /* Данные, от 1 до 64 бит. */
-        if (tms_epilog_nbits > 0) {
-            /* Последний бит надо сопровождать сигналом TMS=1. */
-            tdi_nbits--;
-        }
-        unsigned nbytes = tdi_nbits / 8;
-        unsigned last_byte_bits = tdi_nbits & 7;
-        if (read_flag) {
-            a->high_byte_bits = last_byte_bits;
-            a->fix_high_bit = 0;
-            a->high_byte_mask = 0;
-            a->bytes_per_word = nbytes;
-            if (a->high_byte_bits > 0)
-                a->bytes_per_word++;
-            a->bytes_to_read += a->bytes_per_word;
-        }
-        if (nbytes > 0) {
-            /* Целые байты.
-             * 39 - Clock Data Bytes In and Out LSB First
+            /* На FT2232D такой команды нет: выдаём нулевые байты
+             * на TDI, TMS сохраняет прежнее значение.
              * 19 - Clock Data Bytes Out LSB First (no Read) */
-            a->output [a->bytes_to_write++] = read_flag ?
-                (WTDI + RTDO + CLKWNEG + LSB) :
-                (WTDI + CLKWNEG + LSB);
-            a->output [a->bytes_to_write++] = nbytes - 1;
-            a->output [a->bytes_to_write++] = (nbytes - 1) >> 8;
-            while (nbytes-- > 0) {
-                a->output [a->bytes_to_write++] = tdi;
-                tdi >>= 8;
-            }
+            if (a->bytes_to_write > sizeof (a->output) - 64)
+                mpsse_flush_output (a);
+            if (n > sizeof (a->output) - 3 - a->bytes_to_write)
+                n = sizeof (a->output) - 3 - a->bytes_to_write;
+            a->output [a->bytes_to_write++] = WTDI + CLKWNEG + LSB;
         }
-        if (last_byte_bits) {
-            /* Последний нецелый байт.
-             * 3b - Clock Data Bits In and Out LSB First
-             * 1b - Clock Data Bits Out LSB First (no Read) */
-            a->output [a->bytes_to_write++] = read_flag ?
-                (WTDI + RTDO + BITMODE + CLKWNEG + LSB) :
-                (WTDI + BITMODE + CLKWNEG + LSB);
-            a->output [a->bytes_to_write++] = last_byte_bits - 1;
-            a->output [a->bytes_to_write++] = tdi;
-            tdi >>= last_byte_bits;
-            a->high_byte_mask = 0xffULL << (a->bytes_per_word - 1) * 8;
+        a->output [a->bytes_to_write++] = n - 1;
+        a->output [a->bytes_to_write++] = (n - 1) >> 8;
+        if (! a->ft2232h) {
+            memset (a->output + a->bytes_to_write, 0, n);
+            a->bytes_to_write += n;
         }
-        if (tms_epilog_nbits > 0) {
-            /* Последний бит, точнее два.
-             * 6b - Clock Data to TMS Pin with Read
-             * 4b - Clock Data to TMS Pin (no Read) */
-            tdi_nbits++;
-            a->output [a->bytes_to_write++] = read_flag ?
-                (WTMS + RTDO + BITMODE + CLKWNEG + LSB) :
-                (WTMS + BITMODE + CLKWNEG + LSB);
-            a->output [a->bytes_to_write++] = 1;
-            a->output [a->bytes_to_write++] = tdi << 7 | 1 | tms_epilog << 1;
-            tms_epilog_nbits--;
-            tms_epilog >>= 1;
-            if (read_flag) {
-                /* Последний бит придёт в следующем байте.
-                 * Вычисляем маску для коррекции. */
-                a->fix_high_bit = 0x40ULL << (a->bytes_per_word * 8);
-                a->bytes_per_word++;
-                a->bytes_to_read++;
-            }
-        }
-        if (read_flag)
-            a->high_bit_mask = 1ULL << (tdi_nbits - 1);
+        nclk -= n * 8;
     }
-    if (tms_epilog_nbits > 0) {
-        /* Эпилог TMS, от 1 до 7 бит.
-         * 4b - Clock Data to TMS Pin (no Read) */
-        a->output [a->bytes_to_write++] = WTMS + BITMODE + CLKWNEG + LSB;
-        a->output [a->bytes_to_write++] = tms_epilog_nbits - 1;
-        a->output [a->bytes_to_write++] = tms_epilog;
+    if (nclk > 0) {
+        if (a->bytes_to_write > sizeof (a->output) - 3)
+            mpsse_flush_output (a);
+        a->output [a->bytes_to_write++] = cmd;
+        a->output [a->bytes_to_write++] = nclk - 1;
+        a->output [a->bytes_to_write++] = 0;
     }
 }
 
-static unsigned long long mpsse_fix_data (mpsse_adapter_t *a, unsigned long long word)
+/*
+ * Задержка, исполняемая адаптером в потоке команд.
+ * TAP переводится в состояние Run-Test/Idle и получает нужное
+ * число тактов TCK при TMS=0; из этого состояния следующая
+ * транзакция начинается так же, как из Update-DR.
+ */
+static void mpsse_delay (adapter_t *adapter, unsigned usec)
 {
-    unsigned long long fix_high_bit = word & a->fix_high_bit;
-    //if (debug) fprintf (stderr, "fix (%08llx) high_bit=%08llx\n", word, a->fix_high_bit);
+    mpsse_adapter_t *a = mpsse_tap (adapter);
 
-    if (a->high_byte_bits) {
-        /* Корректируем старший байт принятых данных. */
-        unsigned long long high_byte = a->high_byte_mask &
-            ((word & a->high_byte_mask) >> (8 - a->high_byte_bits));
-        word = (word & ~a->high_byte_mask) | high_byte;
-        //if (debug) fprintf (stderr, "Corrected byte %08llx -> %08llx\n", a->high_byte_mask, high_byte);
-    }
-    word &= a->high_bit_mask - 1;
-    if (fix_high_bit) {
-        /* Корректируем старший бит принятых данных. */
-        word |= a->high_bit_mask;
-        //if (debug) fprintf (stderr, "Corrected bit %08llx -> %08llx\n", a->high_bit_mask, word >> 9);
-    }
-    return word;
+    mpsse_idle (a, ((unsigned long long) usec * a->tck_khz + 999) / 1000 + 1);
 }
 
-static unsigned long long mpsse_recv (mpsse_adapter_t *a)
+/*
+ * Прерывание зависшей транзакции AP: бит DAPABORT регистра ABORT.
+ */
+static void mpsse_abort (mpsse_adapter_t *a)
 {
-    unsigned long long word;
-
-    /* Шлём пакет. */
-    mpsse_flush_output (a);
-
-    /* Обрабатываем одно слово. */
-    memcpy (&word, a->input, sizeof (word));
-    return mpsse_fix_data (a, word);
+    a->tap->adapter.stat_aborts++;
+    mpsse_set_ir (a, JTAG_IR_ABORT);
+    mpsse_scan_dr (a, 1ULL << 3, 0);
+    a->tap->tar_valid = 0;
 }
 
-static void mpsse_reset (mpsse_adapter_t *a, int trst, int sysrst, int led)
+/*
+ * Проверка и сброс залипающих флагов ошибок в DP_CTRL_STAT.
+ * У JTAG-DP ответ FAULT не отличается от OK, ошибка транзакции
+ * видна только по флагу SSTICKYERR.
+ */
+static void mpsse_clear_sticky (mpsse_adapter_t *a)
 {
-    unsigned char output [3];
-    unsigned low_output = 0x08; /* TCK idle high */
-    unsigned low_direction = 0x1b;
-    unsigned high_direction = 0x0f;
-    unsigned high_output = 0;
-
-    /* command "set data bits low byte" */
-    output [0] = 0x80;
-    output [1] = low_output;
-    output [2] = low_direction;
-    bulk_write (a, output, 3);
-
-    if (! trst)
-        high_output |= 1;
-
-    if (sysrst)
-        high_output |= 2;
-
-    if (led)
-        high_output |= 8;
-
-    /* command "set data bits high byte" */
-    output [0] = 0x82;
-    output [1] = high_output;
-    output [2] = high_direction;
-
-    bulk_write (a, output, 3);
-    if (debug_level)
-        fprintf (stderr, "mpsse_reset (trst=%d, sysrst=%d) high_output=0x%2.2x, high_direction: 0x%2.2x\n",
-            trst, sysrst, high_output, high_direction);
+    unsigned stat;
+
+    mpsse_set_ir (a, JTAG_IR_DPACC);
+    mpsse_scan_dr (a, (DP_CTRL_STAT >> 1) | 1, 0);
+    mpsse_scan_dr (a, (DP_RDBUFF >> 1) | 1, 1);
+    stat = mpsse_recv_dr (a) >> 3;
+    if (stat & (SSTICKYERR | SSTICKYORUN)) {
+        a->tap->adapter.stat_faults++;
+        if (debug_level)
+            fprintf (stderr, "DP fault, CTRL/STAT = %08x\n", stat);
+        mpsse_dp_write (&a->tap->adapter, DP_CTRL_STAT,
+            (stat & (CSYSPWRUPREQ | CDBGPWRUPREQ | CORUNDETECT)) |
+            SSTICKYERR | SSTICKYORUN);
+    }
 }
 
-static void mpsse_speed (mpsse_adapter_t *a, int divisor)
+/*
+ * Повтор чтения, получившего ответ WAIT. Перед каждой попыткой
+ * выдерживается пауза, начиная с retry_backoff микросекунд и удваиваясь
+ * (до 1 мсек); после retry_max попыток зависшая транзакция прерывается.
+ * Возвращает 0 при неудаче.
+ */
+static int mpsse_retry (mpsse_adapter_t *a, unsigned *data, int dp,
+    int reg, unsigned addr)
 {
-    unsigned char output [3];
+    adapter_t *adapter = &a->tap->adapter;
+    unsigned usec = adapter->retry_backoff;
+    unsigned long long reply;
+    unsigned ack;
+    int n;
+
+    for (n=0; n<adapter->retry_max; n++) {
+        adapter->stat_retries++;
+        if (usec > 0) {
+            mpsse_delay (adapter, usec);
+            if (usec < 1000)
+                usec *= 2;
+        }
+        if (dp) {
+            mpsse_set_ir (a, JTAG_IR_DPACC);
+            mpsse_scan_dr (a, (reg >> 1) | 1, 0);
+        } else {
+            if (addr != NO_ADDR)
+                mpsse_mem_ap_write (adapter, MEM_AP_TAR, addr);
+            mpsse_select_bank (a, reg);
+            mpsse_set_ir (a, JTAG_IR_APACC);
+            mpsse_scan_dr (a, (reg >> 1 & 6) | 1, 0);
+            if (reg == MEM_AP_DRW)
+                a->tap->tar_valid = 0;
+        }
+        mpsse_set_ir (a, JTAG_IR_DPACC);
+        mpsse_scan_dr (a, (DP_RDBUFF >> 1) | 1, 1);
+        reply = mpsse_recv_dr (a);
+        ack = (unsigned) reply & 7;
+        if (ack == 2 || (dp && ack == 1)) {
+            *data = reply >> 3;
+            return 1;
+        }
 
-    /* command "set TCK divisor" */
-    output [0] = 0x86;
-    output [1] = divisor;
-    output [2] = divisor >> 8;
-    bulk_write (a, output, 3);
+        /* Ответ WAIT выставил SSTICKYORUN: без сброса
+         * следующая попытка была бы проигнорирована. */
+        mpsse_clear_sticky (a);
+    }
+    if (debug_level)
+        fprintf (stderr, "read of %s (%02x) aborted after %d retries\n",
+            dp ? DP_REGNAME(reg) : MEM_AP_REGNAME(reg), reg, n);
+    mpsse_abort (a);
+    *data = 0;
+    return 0;
 }
 
-static void mpsse_close (adapter_t *adapter)
+/*
+ * Запись регистра DP через SWD. Залипающие флаги SW-DP сбрасываются
+ * через регистр ABORT. Обнаружение переполнения включено всегда:
+ * тогда после ответа WAIT или FAULT фаза данных сохраняется, и поток
+ * заранее сформированных транзакций не сбивается.
+ */
+static void swd_dp_write (adapter_t *adapter, int reg, unsigned value)
 {
-    mpsse_adapter_t *a = (mpsse_adapter_t*) adapter;
+    mpsse_adapter_t *a = mpsse_tap (adapter);
+    unsigned clear = 0;
 
-    mpsse_flush_output (a);
-    mpsse_reset (a, 0, 0, 0);
-    usb_release_interface (a->usbdev, 0);
-    usb_close (a->usbdev);
-    free (a);
+    if (! mpsse_shadow (a, 0, reg, value))
+        return;
+    if (reg == DP_CTRL_STAT) {
+        if (value & SSTICKYCMP)
+            clear |= STKCMPCLR;
+        if (value & SSTICKYERR)
+            clear |= STKERRCLR | WDERRCLR;
+        if (value & SSTICKYORUN)
+            clear |= ORUNERRCLR;
+        if (clear)
+            swd_transfer (a, 0, DP_ABORT, 0, clear);
+        value &= ~(SSTICKYCMP | SSTICKYERR | SSTICKYORUN);
+        value |= CORUNDETECT;
+    }
+    swd_transfer (a, 0, reg, 0, value);
+    if (debug_level > 1) {
+        fprintf (stderr, "DP write %08x to %s (%02x)\n", value,
+            DP_REGNAME(reg), reg);
+    }
 }
 
 /*
- * Read the Device Identification code
+ * Отложенное чтение регистра DP через SWD: значение приходит
+ * в ответе на ту же транзакцию.
  */
-static unsigned mpsse_get_idcode (adapter_t *adapter)
+static void swd_dp_queue_read (adapter_t *adapter, int reg, unsigned *data)
 {
-    mpsse_adapter_t *a = (mpsse_adapter_t*) adapter;
-    unsigned idcode;
+    mpsse_adapter_t *a = mpsse_tap (adapter);
 
-    /* Reset the JTAG TAP controller: TMS 1-1-1-1-1-0.
-     * After reset, the IDCODE register is always selected.
-     * Read out 32 bits of data. */
-    mpsse_send (a, 6, 31, 32, 0, 1);
-    idcode = mpsse_recv (a);
-    return idcode;
+    swd_transfer (a, 0, reg, 1, 0);
+    mpsse_queue (a, data, 1, reg, NO_ADDR);
 }
 
 /*
- * Запись регистра DP.
+ * Запись регистра MEM-AP через SWD.
  */
-static void mpsse_dp_write (adapter_t *adapter, int reg, unsigned value)
+static void swd_mem_ap_write (adapter_t *adapter, int reg, unsigned value)
 {
-    mpsse_adapter_t *a = (mpsse_adapter_t*) adapter;
+    mpsse_adapter_t *a = mpsse_tap (adapter);
 
-    mpsse_send (a, 1, 1, 4, JTAG_IR_DPACC, 0);
-    mpsse_send (a, 0, 0, 32 + 3, (reg >> 1) |
-        (unsigned long long) value << 3, 0);
+    mpsse_select_bank (a, reg);
+    if (! mpsse_shadow (a, 1, reg, value))
+        return;
+    swd_transfer (a, 1, reg, 0, value);
+    if (reg == MEM_AP_DRW || (reg & 0xF0) == MEM_AP_BD0)
+        a->tap->wrote = 1;
+    if (reg == MEM_AP_DRW)
+        mpsse_tar_advance (a, 1);
     if (debug_level > 1) {
-        fprintf (stderr, "DP write %08x to %s (%02x)\n", value,
-            DP_REGNAME(reg), reg);
+        fprintf (stderr, "MEM-AP write %08x to %s (%02x)\n", value,
+            MEM_AP_REGNAME(reg), reg);
     }
 }
 
 /*
- * Чтение регистра DP.
+ * Отложенное чтение регистра MEM-AP через SWD. Чтение AP выдаёт
+ * значение предыдущего чтения, поэтому его ответ только проверяется
+ * (в очереди без адреса данных), а значение берётся из RDBUFF.
  */
-static unsigned mpsse_dp_read (adapter_t *adapter, int reg)
+static void swd_mem_ap_queue_read (adapter_t *adapter, int reg, unsigned *data)
 {
-    mpsse_adapter_t *a = (mpsse_adapter_t*) adapter;
-
-    /* Читаем содержимое регистра DP. */
-    mpsse_send (a, 1, 1, 4, JTAG_IR_DPACC, 0);
-    mpsse_send (a, 0, 0, 32 + 3, (reg >> 1) | 1, 0);
-    mpsse_send (a, 0, 0, 32 + 3, (DP_RDBUFF >> 1) | 1, 1);
-    unsigned long long reply = mpsse_recv (a);
-
-    /* Предыдущая транзакция MEM-AP могла завершиться неуспешно.
-     * Анализируем ответ WAIT. */
-    adapter->stalled = (((unsigned) reply & 7) != 2) && (((unsigned) reply & 7) != 1);
-    //adapter->stalled = ((unsigned) reply & 7) != 2;
-    if (adapter->stalled) {
-        if (debug_level > 1)
-            fprintf (stderr, "DP read <<<WAIT>>> from %s (%02x)\n",
-                DP_REGNAME(reg), reg);
-        return 0;
-    }
-
-    unsigned value = reply >> 3;
-    if (debug_level > 1) {
-        fprintf (stderr, "DP read %08x from %s (%02x)\n", value,
-            DP_REGNAME(reg), reg);
-    }
-    return value;
+    mpsse_adapter_t *a = mpsse_tap (adapter);
+    unsigned addr;
+
+    mpsse_select_bank (a, reg);
+    addr = (reg == MEM_AP_DRW && a->tap->tar_valid) ? a->tap->tar : NO_ADDR;
+    swd_transfer (a, 1, reg, 1, 0);
+    mpsse_queue (a, 0, 0, reg, addr);
+    if (reg == MEM_AP_DRW)
+        mpsse_tar_advance (a, 1);
+
+    swd_transfer (a, 0, DP_RDBUFF, 1, 0);
+    mpsse_queue (a, data, 0, reg, addr);
 }
 
 /*
- * Запись регистра MEM-AP.
- * Старшие биты адреса должны быть предварительно занесены в регистр DP_SELECT.
+ * Проверка и сброс залипающих флагов через регистр ABORT.
+ * Чтение CTRL/STAT разрешено и при выставленных флагах.
  */
-static void mpsse_mem_ap_write (adapter_t *adapter, int reg, unsigned value)
+static void swd_clear_sticky (mpsse_adapter_t *a)
 {
-    mpsse_adapter_t *a = (mpsse_adapter_t*) adapter;
+    unsigned stat, ack;
 
-    /* Пишем в регистр MEM-AP. */
-    mpsse_send (a, 1, 1, 4, JTAG_IR_APACC, 0);
-    mpsse_send (a, 0, 0, 32 + 3, (reg >> 1 & 6) |
-        (unsigned long long) value << 3, 0);
-    if (debug_level > 1) {
-        fprintf (stderr, "MEM-AP write %08x to %s (%02x)\n", value,
-            MEM_AP_REGNAME(reg), reg);
+    swd_transfer (a, 0, DP_CTRL_STAT, 1, 0);
+    mpsse_flush_output (a);
+    ack = swd_reply (a->input, &stat);
+    a->bytes_received = 0;
+    if (ack != SWD_ACK_OK || (stat & (SSTICKYERR | SSTICKYORUN | WDATAERR))) {
+        a->tap->adapter.stat_faults++;
+        if (debug_level)
+            fprintf (stderr, "DP fault, ack %u, CTRL/STAT = %08x\n", ack, stat);
+        swd_transfer (a, 0, DP_ABORT, 0, STKERRCLR | WDERRCLR | ORUNERRCLR);
+        a->tap->tar_valid = 0;
     }
 }
 
 /*
- * Чтение регистра MEM-AP.
- * Старшие биты адреса должны быть предварительно занесены в регистр DP_SELECT.
+ * Повтор отвергнутого чтения через SWD, как в mpsse_retry().
  */
-static unsigned mpsse_mem_ap_read (adapter_t *adapter, int reg)
+static int swd_retry (mpsse_adapter_t *a, unsigned *data, int dp,
+    int reg, unsigned addr)
 {
-    mpsse_adapter_t *a = (mpsse_adapter_t*) adapter;
+    adapter_t *adapter = &a->tap->adapter;
+    unsigned usec = adapter->retry_backoff;
+    unsigned ack, value;
+    int n;
+
+    for (n=0; n<adapter->retry_max; n++) {
+        adapter->stat_retries++;
+        if (usec > 0) {
+            mpsse_delay (adapter, usec);
+            if (usec < 1000)
+                usec *= 2;
+        }
+        if (dp) {
+            swd_transfer (a, 0, reg, 1, 0);
+        } else {
+            if (addr != NO_ADDR)
+                swd_mem_ap_write (adapter, MEM_AP_TAR, addr);
+            mpsse_select_bank (a, reg);
+            swd_transfer (a, 1, reg, 1, 0);
+            swd_transfer (a, 0, DP_RDBUFF, 1, 0);
+            if (reg == MEM_AP_DRW)
+                a->tap->tar_valid = 0;
+        }
+        mpsse_flush_output (a);
+        ack = swd_reply (a->input, &value);
+        if (! dp && ack == SWD_ACK_OK)
+            ack = swd_reply (a->input + SWD_REPLY, &value);
+        a->bytes_received = 0;
+        if (ack == SWD_ACK_OK) {
+            *data = value;
+            return 1;
+        }
+        swd_clear_sticky (a);
+    }
+    if (debug_level)
+        fprintf (stderr, "read of %s (%02x) aborted after %d retries\n",
+            dp ? DP_REGNAME(reg) : MEM_AP_REGNAME(reg), reg, n);
+    adapter->stat_aborts++;
+    swd_transfer (a, 0, DP_ABORT, 0, DAPABORT);
+    a->tap->tar_valid = 0;
+    *data = 0;
+    return 0;
+}
 
-    /* Читаем содержимое регистра MEM-AP. */
-    mpsse_send (a, 1, 1, 4, JTAG_IR_APACC, 0);
-    mpsse_send (a, 0, 0, 32 + 3, (reg >> 1 & 6) | 1, 0);
-
-    /* Извлекаем прочитанное значение из регистра RDBUFF. */
-    mpsse_send (a, 1, 1, 4, JTAG_IR_DPACC, 0);
-    mpsse_send (a, 0, 0, 32 + 3, (DP_RDBUFF >> 1) | 1, 1);
-    unsigned long long reply = mpsse_recv (a);
-
-    /* Предыдущая транзакция MEM-AP могла завершиться неуспешно.
-     * Анализируем ответ WAIT. */
-    adapter->stalled = ((unsigned) reply & 7) != 2;
-    if (adapter->stalled) {
-        if (debug_level > 1)
-            fprintf (stderr, "MEM-AP read <<<WAIT>>> from %s (%02x)\n",
-                MEM_AP_REGNAME(reg), reg);
-        return 0;
+/*
+ * Выполнение накопленных транзакций SWD и разбор ответов.
+ * После ответа WAIT или FAULT выставлен залипающий флаг, и все
+ * последующие обращения к AP отвергаются. Ответы на записи
+ * не принимаются, поэтому пакет завершается чтением CTRL/STAT
+ * (оно разрешено и при выставленных флагах). При сбое флаги
+ * сбрасываются; если в пакете были записи в память, выставляется
+ * stalled, как в mpsse_flush(), иначе оставшиеся значения
+ * читаются заново, по одному.
+ */
+static void swd_flush (adapter_t *adapter)
+{
+    mpsse_adapter_t *a = mpsse_tap (adapter);
+    mpsse_tap_t *t = a->tap;
+    unsigned ack, value;
+    int i, n, failed = 0, first_fail = -1;
+
+    if (t->used) {
+        /* Такты простоя, чтобы последняя запись завершилась. */
+        mpsse_idle (a, 8);
+        t->stat = 0;
+        swd_transfer (a, 0, DP_CTRL_STAT, 1, 0);
+        mpsse_queue (a, &t->stat, 1, DP_CTRL_STAT, NO_ADDR);
     }
-    unsigned value = reply >> 3;
-    if (debug_level > 1) {
-        fprintf (stderr, "MEM-AP read %08x from %s (%02x)\n", value,
-            MEM_AP_REGNAME(reg), reg);
+    mpsse_flush_output (a);
+    for (i=0; i<a->queue_len; i++) {
+        ack = swd_reply (a->input + i*SWD_REPLY, &value);
+        if (ack != SWD_ACK_OK) {
+            if (debug_level > 1)
+                fprintf (stderr, "read <<<%s>>>\n",
+                    ack == SWD_ACK_WAIT ? "WAIT" :
+                    ack == SWD_ACK_FAULT ? "FAULT" : "no ACK");
+            if (ack == SWD_ACK_WAIT)
+                adapter->stat_wait++;
+            failed = 1;
+            if (first_fail < 0)
+                first_fail = i;
+            continue;
+        }
+        if (a->queue[i].data && first_fail < 0)
+            *a->queue[i].data = value;
+        else if (a->queue[i].data == &t->stat)
+            t->stat = value;
     }
-    return value;
+    n = a->queue_len;
+    a->queue_len = 0;
+    a->bytes_received = 0;
+    if (t->stat & (SSTICKYERR | SSTICKYORUN | WDATAERR))
+        failed = 1;
+
+    if (failed) {
+        /* Записи TAR, CSW и DP_SELECT могли быть отброшены. */
+        swd_clear_sticky (a);
+        t->select_valid = 0;
+        t->csw_valid = 0;
+        t->tar_valid = 0;
+        if (t->wrote) {
+            if (debug_level)
+                fprintf (stderr, "writes dropped, CTRL/STAT = %08x\n", t->stat);
+            t->lost = 1;
+        } else if (first_fail >= 0) {
+            for (i=first_fail; i<n; i++) {
+                if (! a->queue[i].data || a->queue[i].data == &t->stat)
+                    continue;
+                if (! mpsse_can_retry (a->queue[i].dp,
+                    a->queue[i].reg, a->queue[i].addr) ||
+                    ! swd_retry (a, a->queue[i].data, a->queue[i].dp,
+                    a->queue[i].reg, a->queue[i].addr))
+                    t->lost = 1;
+            }
+        }
+    }
+    t->used = 0;
+    t->wrote = 0;
+    adapter->stalled = t->lost;
+    t->lost = 0;
 }
 
 /*
- * Чтение блока памяти.
- * Предварительно в регистр DP_SELECT должен быть занесён 0.
- * Количество слов не больше 10, иначе переполняется буфер USB.
+ * Чтение блока памяти через SWD, частями в пределах 1 кбайта.
  */
-static void mpsse_read_data (adapter_t *adapter,
+static void swd_read_data (adapter_t *adapter,
     unsigned addr, unsigned nwords, unsigned *data)
 {
-    mpsse_adapter_t *a = (mpsse_adapter_t*) adapter;
+    mpsse_adapter_t *a = mpsse_tap (adapter);
+    unsigned i, n;
+
+    for (; nwords > 0; nwords -= n, addr += n*4, data += n) {
+        n = (0x400 - (addr & 0x3FF)) / 4;
+        if (n > nwords)
+            n = nwords;
+
+        swd_mem_ap_write (adapter, MEM_AP_TAR, addr);
+        mpsse_select_bank (a, MEM_AP_DRW);
+
+        /* Каждое чтение DRW выдаёт значение предыдущего. */
+        swd_transfer (a, 1, MEM_AP_DRW, 1, 0);
+        mpsse_queue (a, 0, 0, MEM_AP_DRW, NO_ADDR);
+        for (i=1; i<n; i++) {
+            swd_transfer (a, 1, MEM_AP_DRW, 1, 0);
+            mpsse_queue (a, data + i-1, 0, MEM_AP_DRW, addr + (i-1)*4);
+        }
+        swd_transfer (a, 0, DP_RDBUFF, 1, 0);
+        mpsse_queue (a, data + n-1, 0, MEM_AP_DRW, addr + (n-1)*4);
+        mpsse_tar_advance (a, n);
+    }
+    swd_flush (adapter);
+}
 
-    /* Пишем адрес в регистр TAR. */
-    mpsse_mem_ap_write (adapter, MEM_AP_TAR, addr);
+/*
+ * Чтение идентификатора SW-DP. После сброса линии
+ * первой транзакцией должно быть чтение IDCODE.
+ */
+static unsigned swd_get_idcode (adapter_t *adapter)
+{
+    mpsse_adapter_t *a = mpsse_tap (adapter);
+    unsigned idcode;
 
-    /* Запрашиваем данные через регистр DRW.
-     * Первое чтение не выдаёт значения. */
-    mpsse_send (a, 1, 1, 4, JTAG_IR_APACC, 0);
-    mpsse_send (a, 0, 0, 32 + 3, (MEM_AP_DRW >> 1 & 6) | 1, 0);
-    unsigned i;
-    for (i=0; i<nwords; i++) {
-        mpsse_send (a, 1, 1, 4, JTAG_IR_APACC, 0);
-        mpsse_send (a, 0, 0, 32 + 3, (MEM_AP_DRW >> 1 & 6) | 1, 1);
-    }
-    /* Шлём пакет. */
+    swd_flush (adapter);
+    swd_sequence (a, swd_line_reset, sizeof (swd_line_reset));
+    mpsse_invalidate (a);
+    swd_transfer (a, 0, DP_IDCODE, 1, 0);
     mpsse_flush_output (a);
-
-    /* Извлекаем и обрабатываем данные. */
-    for (i=0; i<nwords; i++) {
-        unsigned long long reply;
-        memcpy (&reply, a->input + i*a->bytes_per_word, sizeof (reply));
-        reply = mpsse_fix_data (a, reply);
-        adapter->stalled = ((unsigned) reply & 7) != 2;
-        data[i] = reply >> 3;
-    }
+    if (swd_reply (a->input, &idcode) != SWD_ACK_OK)
+        idcode = 0;
+    a->bytes_received = 0;
+    return idcode;
 }
 
 /*
@@ -546,11 +2553,20 @@ static void mpsse_read_data (adapter_t *adapter,
  */
 static void mpsse_reset_cpu (adapter_t *adapter)
 {
-    mpsse_adapter_t *a = (mpsse_adapter_t*) adapter;
+    mpsse_adapter_t *a = mpsse_tap (adapter);
+    int i;
 
     /* Забываем невыполненную транзакцию. */
     a->bytes_to_write = 0;
     a->bytes_to_read = 0;
+    a->bytes_received = 0;
+    a->queue_len = 0;
+    a->pending.tap = 0;
+    for (i=0; i<a->ntaps; i++) {
+        a->taps[i].used = 0;
+        a->taps[i].wrote = 0;
+    }
+    mpsse_invalidate (a);
 
     /* Активируем /SYSRST на несколько микросекунд. */
     mpsse_reset (a, 1, 1, 1);
@@ -558,68 +2574,44 @@ static void mpsse_reset_cpu (adapter_t *adapter)
 }
 
 /*
- * Инициализация адаптера F2232.
- * Возвращаем указатель на структуру данных, выделяемую динамически.
+ * Инициализация адаптера F2232 и определение цепочки JTAG.
  * Если адаптер не обнаружен, возвращаем 0.
  */
-adapter_t *adapter_open_mpsse (void)
+static mpsse_adapter_t *mpsse_open_device (void)
 {
     mpsse_adapter_t *a;
-    struct usb_bus *bus;
-    struct usb_device *dev;
+    int err;
 
-    usb_init();
-    usb_find_busses();
-    usb_find_devices();
-    for (bus = usb_get_busses(); bus; bus = bus->next) {
-        for (dev = bus->devices; dev; dev = dev->next) {
-            if (dev->descriptor.idVendor == OLIMEX_VID &&
-                (dev->descriptor.idProduct == OLIMEX_ARM_USB_OCD ||
-                 dev->descriptor.idProduct == OLIMEX_ARM_USB_TINY ||
-                 dev->descriptor.idProduct == OLIMEX_ARM_USB_TINY_H ||
-                 dev->descriptor.idProduct == OLIMEX_ARM_USB_OCD_H))
-                goto found;
-        }
-    }
-    /*fprintf (stderr, "USB adapter not found: vid=%04x, pid=%04x\n",
-        OLIMEX_VID, OLIMEX_PID);*/
-    return 0;
-found:
-    /*fprintf (stderr, "found USB adapter: vid %04x, pid %04x, type %03x\n",
-        dev->descriptor.idVendor, dev->descriptor.idProduct,
-        dev->descriptor.bcdDevice);*/
-    jtag_adapter_version = dev->descriptor.idProduct;
     a = calloc (1, sizeof (*a));
     if (! a) {
         fprintf (stderr, "Out of memory\n");
         return 0;
     }
-    a->usbdev = usb_open (dev);
-    if (! a->usbdev) {
-        fprintf (stderr, "MPSSE adapter: usb_open() failed\n");
+    a->tap = &a->taps[0];
+    if (! usb_open_adapter (a)) {
         free (a);
         return 0;
     }
-    usb_claim_interface (a->usbdev, 0);
 
     /* Reset the ftdi device. */
-    if (usb_control_msg (a->usbdev,
-        USB_TYPE_VENDOR | USB_RECIP_DEVICE | USB_ENDPOINT_OUT,
-        SIO_RESET, 0, 1, 0, 0, 1000) != 0) {
+    err = ftdi_control (a, 0, SIO_RESET, 0, 0, 0);
+    if (err != 0) {
+#ifdef LIBUSB1
+        /* libusb-1.0 возвращает код ошибки, errno не выставляется. */
+        if (err == LIBUSB_ERROR_ACCESS)
+#else
         if (errno == EPERM)
+#endif
             fprintf (stderr, "MPSSE adapter: superuser privileges needed.\n");
         else
             fprintf (stderr, "MPSSE adapter: FTDI reset failed\n");
-failed: usb_release_interface (a->usbdev, 0);
-        usb_close (a->usbdev);
+failed: usb_close_adapter (a);
         free (a);
         return 0;
     }
 
     /* MPSSE mode. */
-    if (usb_control_msg (a->usbdev,
-        USB_TYPE_VENDOR | USB_RECIP_DEVICE | USB_ENDPOINT_OUT,
-        SIO_SET_BITMODE, 0x20b, 1, 0, 0, 1000) != 0) {
+    if (ftdi_control (a, 0, SIO_SET_BITMODE, 0x20b, 0, 0) != 0) {
         fprintf (stderr, "Can't set sync mpsse mode\n");
         goto failed;
     }
@@ -637,33 +2629,70 @@ failed: usb_release_interface (a->usbdev, 0);
 #endif
     } else if (jtag_adapter_version == OLIMEX_ARM_USB_TINY_H || 
                jtag_adapter_version == OLIMEX_ARM_USB_OCD_H) {
-        divisor = 1;
+        divisor = 9;            /* 3 МГц от опорной частоты 30 МГц */
         latency_timer = 0;
     }
 
-    if (usb_control_msg (a->usbdev,
-        USB_TYPE_VENDOR | USB_RECIP_DEVICE | USB_ENDPOINT_OUT,
-        SIO_SET_LATENCY_TIMER, latency_timer, 1, 0, 0, 1000) != 0) {
+    /* FT2232D: пакеты по 64 байта, буфер передачи 128 байт.
+     * FT2232H: пакеты по 512 байт, буфер передачи 4 кбайта. */
+    if (jtag_adapter_version == OLIMEX_ARM_USB_TINY_H ||
+        jtag_adapter_version == OLIMEX_ARM_USB_OCD_H) {
+        a->ft2232h = 1;
+        a->max_packet = 512;
+        a->max_reply = 4096 - 512;
+    } else {
+        a->max_packet = 64;
+        a->max_reply = 128 - 8;
+    }
+    if (! a->serial[0])
+        sprintf (a->serial, "pid-%04x", jtag_adapter_version);
+    if (adapter_speed > 0) {
+        divisor = mpsse_divisor (a, adapter_speed);
+    } else {
+        /* Значения, найденные при калибровке этого адаптера. */
+        unsigned khz, latency;
+
+        if (profile_load (a, &khz, &latency)) {
+            divisor = mpsse_divisor (a, khz);
+            latency_timer = latency;
+            if (debug_level)
+                fprintf (stderr, "MPSSE: profile for %s\n", a->serial);
+        }
+    }
+
+    if (ftdi_control (a, 0, SIO_SET_LATENCY_TIMER, latency_timer, 0, 0) != 0) {
         fprintf (stderr, "unable to set latency timer\n");
         goto failed;
     }
-    if (usb_control_msg (a->usbdev,
-        USB_TYPE_VENDOR | USB_RECIP_DEVICE | USB_ENDPOINT_IN,
-        SIO_GET_LATENCY_TIMER, 0, 1, (char*) &latency_timer, 1, 1000) != 1) {
+    if (ftdi_control (a, 1, SIO_GET_LATENCY_TIMER, 0, &latency_timer, 1) != 1) {
         fprintf (stderr, "unable to get latency timer\n");
         goto failed;
     }
+    a->latency = latency_timer;
     if (debug_level) {
     	fprintf (stderr, "MPSSE: divisor: %u\n", divisor);
     	fprintf (stderr, "MPSSE: latency timer: %u usec\n", latency_timer);
     }
+#ifdef IOTHREAD
+    iothread_start (a);
+#endif
+    a->swd = adapter_swd;
     mpsse_reset (a, 0, 0, 1);
 
-    if (debug_level) {
-        int baud = 6000000 / (divisor + 1);
-        fprintf (stderr, "MPSSE: speed %d samples/sec\n", baud);
+    if (a->ft2232h) {
+        /* FT2232H: отключаем делитель частоты на 5, адаптивную
+         * синхронизацию (у Cortex-M3 нет сигнала RTCK) и трёхфазную
+         * синхронизацию данных, которая нужна только для I2C.
+         * 8a - Disable Clk Divide by 5
+         * 97 - Turn Off Adaptive clocking
+         * 8d - Disable 3 Phase Data Clocking */
+        unsigned char clock_setup[] = "\x8a\x97\x8d";
+        bulk_write (a, clock_setup, 3);
     }
     mpsse_speed (a, divisor);
+    if (debug_level) {
+        fprintf (stderr, "MPSSE: TCK %u kHz\n", a->tck_khz);
+    }
 
     /* Disable TDI to TDO loopback. */
     unsigned char enable_loopback[] = "\x85";
@@ -672,17 +2701,81 @@ failed: usb_release_interface (a->usbdev, 0);
     mpsse_reset (a, 1, 1, 1);
     mpsse_reset (a, 0, 0, 1);
 
-    /* Reset the JTAG TAP controller. */
-    mpsse_send (a, 6, 31, 0, 0, 0);         /* TMS 1-1-1-1-1-0 */
+    if (a->swd) {
+        /* Переключаем порт отладки из JTAG в SWD.
+         * Устройство на линии SWD может быть только одно. */
+        swd_sequence (a, swd_jtag_to_swd, sizeof (swd_jtag_to_swd));
+        a->ntaps = 1;
+        a->taps[0].dev = a;
+        a->taps[0].irlen = 4;
+        a->taps[0].adapter.ntaps = 1;
+    } else if (! mpsse_scan_chain (a)) {
+        mpsse_close_device (a);
+        return 0;
+    }
+    mpsse_invalidate (a);
+    return a;
+}
+
+/*
+ * Открытие устройства номер tap в цепочке JTAG; -1 - первое
+ * устройство с ARM JTAG-DP. Все устройства цепочки работают
+ * через один адаптер, каждое - через свой экземпляр adapter_t.
+ * Возвращаем указатель на него или 0 при ошибке.
+ */
+adapter_t *adapter_open_mpsse (int tap)
+{
+    mpsse_adapter_t *a = mpsse_device;
+    mpsse_tap_t *t;
+
+    if (! a) {
+        a = mpsse_open_device ();
+        if (! a)
+            return 0;
+        mpsse_device = a;
+    }
+    if (tap < 0) {
+        for (tap=0; tap<a->ntaps-1; tap++)
+            if (IS_ARM_DP (a->taps[tap].adapter.chain[tap]))
+                break;
+    }
+    if (tap >= a->ntaps || a->taps[tap].irlen != 4 ||
+        a->taps[tap].adapter.close) {
+        fprintf (stderr, "MPSSE adapter: no ARM debug port at JTAG chain position %d\n", tap);
+        if (a->nopen == 0)
+            mpsse_close_device (a);
+        return 0;
+    }
+    t = &a->taps[tap];
+    a->nopen++;
 
     /* Обязательные функции. */
-    a->adapter.close = mpsse_close;
-    a->adapter.get_idcode = mpsse_get_idcode;
-    a->adapter.reset_cpu = mpsse_reset_cpu;
-    a->adapter.dp_read = mpsse_dp_read;
-    a->adapter.dp_write = mpsse_dp_write;
-    a->adapter.mem_ap_read = mpsse_mem_ap_read;
-    a->adapter.mem_ap_write = mpsse_mem_ap_write;
-    a->adapter.read_data = mpsse_read_data;
-    return &a->adapter;
+    t->adapter.close = mpsse_close;
+    t->adapter.get_idcode = mpsse_get_idcode;
+    t->adapter.reset_cpu = mpsse_reset_cpu;
+    t->adapter.dp_read = mpsse_dp_read;
+    t->adapter.dp_write = mpsse_dp_write;
+    t->adapter.mem_ap_read = mpsse_mem_ap_read;
+    t->adapter.mem_ap_write = mpsse_mem_ap_write;
+    t->adapter.read_data = mpsse_read_data;
+    t->adapter.dp_queue_read = mpsse_dp_queue_read;
+    t->adapter.mem_ap_queue_read = mpsse_mem_ap_queue_read;
+    t->adapter.flush = mpsse_flush;
+    t->adapter.delay = mpsse_delay;
+    t->adapter.retry_max = 8;
+    t->adapter.retry_backoff = 1;
+    if (a->swd) {
+        t->adapter.get_idcode = swd_get_idcode;
+        t->adapter.dp_write = swd_dp_write;
+        t->adapter.mem_ap_write = swd_mem_ap_write;
+        t->adapter.read_data = swd_read_data;
+        t->adapter.dp_queue_read = swd_dp_queue_read;
+        t->adapter.mem_ap_queue_read = swd_mem_ap_queue_read;
+        t->adapter.flush = swd_flush;
+    }
+
+    /* Необязательные функции. */
+    t->adapter.set_clock = mpsse_set_clock;
+    t->adapter.save_profile = mpsse_save_profile;
+    return &t->adapter;
 }
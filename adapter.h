@@ -17,16 +17,47 @@
 
 typedef struct _adapter_t adapter_t;
 
+#define MAX_TAPS        8       /* наибольшее число устройств в цепочке JTAG */
+
 struct _adapter_t {
     /*
      * Флаг, указывающий, что предыдущая транзакция AP read/write
      * не завершилась и требует повтора. Устанавливается и сбрасывается
-     * функциями dp_read() и mem_ap_read().
+     * функциями dp_read(), mem_ap_read() и flush(). Выставляется также,
+     * если после ответа WAIT порт отладки отбросил записи в память
+     * (DRW, BD0-BD3): их повторяет вызывающая сторона.
      */
     int stalled;
 
+    /*
+     * Повтор чтений, получивших ответ WAIT: число попыток и начальная
+     * пауза в микросекундах, удваиваемая с каждой попыткой.
+     * Статистика: ответы WAIT, повторы, ошибки транзакций (SSTICKYERR)
+     * и прерванные через DP_ABORT транзакции.
+     */
+    int retry_max;
+    unsigned retry_backoff;
+    unsigned stat_wait, stat_retries, stat_faults, stat_aborts;
+
+    /*
+     * Цепочка JTAG: число устройств, их идентификаторы
+     * (0 - устройство без регистра IDCODE) и номер устройства,
+     * с которым работает этот экземпляр; 0 - ближайшее к TDO.
+     */
+    int ntaps, tap;
+    unsigned chain [MAX_TAPS];
+
+    /*
+     * Текущая частота TCK (SWCLK) в кГц, 0 - неизвестна. По ней
+     * оценивается длительность последовательности транзакций.
+     */
+    unsigned tck_khz;
+
     /*
      * Обязательные функции.
+     * Банк регистров MEM-AP в DP_SELECT выбирается адаптером;
+     * повторная запись того же значения в DP_SELECT, CSW и TAR
+     * (с учётом автоинкремента TAR) пропускается.
      */
     void (*close) (adapter_t *a);
     unsigned (*get_idcode) (adapter_t *a);
@@ -36,9 +67,40 @@ struct _adapter_t {
     void (*mem_ap_write) (adapter_t *a, int reg, unsigned val);
     unsigned (*mem_ap_read) (adapter_t *a, int reg);
     void (*read_data) (adapter_t *a, unsigned addr, unsigned nwords, unsigned *data);
+
+    /*
+     * Отложенные операции. Запись регистров и так не дожидается
+     * выполнения; запросы чтения накапливаются в той же очереди,
+     * а значения заносятся по указанным адресам при вызове flush().
+     */
+    void (*dp_queue_read) (adapter_t *a, int reg, unsigned *data);
+    void (*mem_ap_queue_read) (adapter_t *a, int reg, unsigned *data);
+    void (*flush) (adapter_t *a);
+
+    /*
+     * Задержка на стороне целевого процессора, в микросекундах.
+     * Вставляется в поток команд между соседними транзакциями,
+     * поэтому выдерживается точно, даже пока пакет не отправлен.
+     */
+    void (*delay) (adapter_t *a, unsigned usec);
+
+    /*
+     * Необязательные функции: подбор частоты TCK (в кГц) и таймера
+     * задержки USB. Функция set_clock() возвращает фактическую частоту
+     * или 0 при ошибке; save_profile() запоминает текущие значения
+     * для данного экземпляра адаптера, чтобы применять их при
+     * следующем открытии.
+     */
+    unsigned (*set_clock) (adapter_t *a, unsigned khz, unsigned latency);
+    void (*save_profile) (adapter_t *a);
 };
 
-adapter_t *adapter_open_mpsse (void);
+adapter_t *adapter_open_mpsse (int tap);
 
 void mdelay (unsigned msec);
 extern int debug_level;
+extern int adapter_speed;       /* частота TCK в кГц, 0 - по умолчанию */
+extern int adapter_swd;         /* работа через SWD вместо JTAG */
+extern int adapter_tap;         /* номер устройства в цепочке, -1 - первый ARM DP */
+extern int adapter_chain_len;   /* число длин IR, заданных вручную */
+extern int adapter_irlen [MAX_TAPS]; /* длины IR устройств цепочки */
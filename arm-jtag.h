@@ -31,6 +31,23 @@
 #define DP_CTRL_STAT		0x4	/* Control/status (r/w) */
 #define DP_SELECT		0x8	/* AP select (r/w) */
 #define DP_RDBUFF		0xC	/* Read buffer (read-only) */
+#define DP_IDCODE		0x0	/* SW-DP: identification (read-only) */
+
+/*
+ * Identification codes of the Cortex-M3 debug port.
+ */
+#define IDCODE_JTAG_DP		0x4ba00477
+#define IDCODE_SW_DP		0x2ba01477
+
+/*
+ * Fields of the SW-DP ABORT register: sticky flags are cleared
+ * here rather than by writing to CTRL/STAT.
+ */
+#define DAPABORT                (1<<0)  /* abort the current AP transaction */
+#define STKCMPCLR               (1<<1)  /* clear SSTICKYCMP */
+#define STKERRCLR               (1<<2)  /* clear SSTICKYERR */
+#define WDERRCLR                (1<<3)  /* clear WDATAERR */
+#define ORUNERRCLR              (1<<4)  /* clear SSTICKYORUN */
 
 #define DP_REGNAME(reg) (reg) == DP_ABORT ? "ABORT" : \
                         (reg) == DP_CTRL_STAT ? "CTRL/STAT" : \
@@ -41,10 +58,13 @@
  */
 #define CORUNDETECT             (1<<0)  /* enable overrun detection */
 #define SSTICKYORUN             (1<<1)  /* overrun detection */
-    /* 3:2 - transaction mode (e.g. pushed compare) */
+#define TRNMODE_NORMAL          (0<<2)  /* 3:2 - transaction mode */
+#define TRNMODE_PUSHED_VERIFY   (1<<2)  /* SSTICKYCMP on mismatch */
+#define TRNMODE_PUSHED_COMPARE  (2<<2)  /* SSTICKYCMP on match */
 #define SSTICKYCMP              (1<<4)  /* match in a pushed compare */
 #define SSTICKYERR              (1<<5)  /* error in AP transaction */
-    /* 11:8 - mask lanes for pushed compare or verify ops */
+#define WDATAERR                (1<<7)  /* SW-DP: write data parity error */
+#define MASKLANE_ALL            (0xf<<8) /* 11:8 - mask lanes for pushed ops */
     /* 21:12 - transaction counter */
 #define CDBGRSTREQ              (1<<26) /* Debug reset request */
 #define CDBGRSTACK              (1<<27) /* Debug reset acknowledge */
@@ -132,6 +152,14 @@
 
 #define DCRSR_WnR               (1 << 16)
 
+/* Номера регистров ядра для DCRSR */
+#define DCRSR_R(n)              (n)
+#define DCRSR_SP                13
+#define DCRSR_PC                15      /* адрес возврата из отладки */
+#define DCRSR_XPSR              16
+
+#define XPSR_T                  (1 << 24)       /* режим Thumb */
+
 /* DCB_DHCSR bit and field definitions */
 #define DBGKEY                  (0xA05F << 16)
 #define C_DEBUGEN               (1 << 0)
@@ -149,6 +177,7 @@
 /*
  * Milandr 1986BE9x register definitions.
  */
+#define CPU_CLOCK               0x4002000C      /* Выбор тактовой частоты процессора */
 #define PER_CLOCK               0x4002001C      /* Разрешение тактовой частоты */
 #define UART1_CR                0x40030030
 #define UART2_CR                0x40038030
@@ -27,11 +27,13 @@
 #include <locale.h>
 
 #include "target.h"
+#include "adapter.h"
 #include "localize.h"
 
 #define VERSION         "1.1"
 #define BLOCKSZ         4096
 #define FLASH_BLOCK_SZ	4096
+#define PAGE_ERASE_MSEC 40              /* стирание страницы, по документации */
 
 /* Macros for converting between hex and binary. */
 #define NIBBLE(x)       (isdigit(x) ? (x)-'0' : tolower(x)+10-'a')
@@ -42,8 +44,24 @@ int memory_len;
 unsigned memory_base;
 unsigned progress_count, progress_step;
 int verify_only;
+int diff_mode;                          /* записывать только изменённые секторы */
 int debug_level;
+int adapter_speed;
+int adapter_swd;
+int adapter_tap = -1;
+int adapter_chain_len;
+int adapter_irlen [MAX_TAPS];
+int tap_list [MAX_TAPS];                /* процессоры, заданные опцией --tap */
+int tap_count;
+int tap_all;
 target_t *target;
+target_t *targets [MAX_TAPS];           /* процессоры цепочки JTAG */
+int ntargets;
+
+/* Секторы образа для каждого процессора: изменённые (--diff)
+ * и требующие стирания. */
+unsigned char sector_changed [MAX_TAPS] [sizeof (memory_data) / FLASH_BLOCK_SZ];
+unsigned char sector_dirty [MAX_TAPS] [sizeof (memory_data) / FLASH_BLOCK_SZ];
 char *progname;
 const char *copyright;
 
@@ -310,6 +328,11 @@ void quit (void)
         free (target);
         target = 0;
     }
+    while (ntargets > 0) {
+        ntargets--;
+        target_close (targets [ntargets]);
+        free (targets [ntargets]);
+    }
 }
 
 void interrupted (int signum)
@@ -332,13 +355,39 @@ void do_probe ()
         target_idcode (target));
     printf (_("Main flash memory: %d kbytes\n"), target_main_flash_bytes (target) / 1024);
     printf (_("Info flash memory: %d kbytes\n"), target_info_flash_bytes (target) / 1024);
+
+    unsigned idcode [MAX_TAPS];
+    int i, n, tap;
+
+    n = target_chain (target, &tap, idcode);
+    if (n > 1) {
+        printf (_("JTAG chain: %d devices\n"), n);
+        for (i=0; i<n; i++)
+            printf (_("    TAP %d: idcode %08X%s\n"), i, idcode[i],
+                i == tap ? _(" (selected)") : "");
+    }
+}
+
+void do_calibrate ()
+{
+    /* Open and detect the device. */
+    atexit (quit);
+    target = target_open (1);
+    if (! target) {
+        fprintf (stderr, _("Error detecting device -- check cable!\n"));
+        exit (1);
+    }
+    printf (_("Processor: %s (id %08X)\n"), target_cpu_name (target),
+        target_idcode (target));
+    if (! target_calibrate (target))
+        exit (1);
 }
 
 void program_block (target_t *mc, unsigned addr, int len, int info_flash)
 {
 //printf("program_block %08X\n", memory_base + addr);
     /* Write flash memory. */
-    target_program_block (mc, memory_base + addr,
+    target_program_next (mc, memory_base + addr,
         (len + 3) / 4, (unsigned*) (memory_data + addr), info_flash);
 }
 
@@ -354,6 +403,12 @@ int verify_block (target_t *mc, unsigned addr, int len, int info_flash)
     int i;
     unsigned word, expected, block [BLOCKSZ/4];
 
+    /* Сравнение выполняет порт отладки; читаем блок,
+     * только чтобы найти место расхождения. */
+    if (debug_level < 2 && target_verify_block (mc, memory_base + addr,
+        (len+3)/4, (unsigned*) (memory_data + addr), info_flash))
+        return 1;
+
 //printf("memory_base+addr=0x%x;(len+3)/4=%d\n",memory_base+addr,(len+3)/4);
     target_read_block (mc, memory_base + addr, (len+3)/4, block, info_flash);
 //printf("block[0]=%x\n",block[0]);
@@ -396,52 +451,357 @@ int check_erasure (target_t *mc, unsigned addr, int info_flash)
     return 1;
 }
 
-void do_program (char *filename, int info_flash)
+/*
+ * Поиск секторов flash-памяти, отличающихся от образа.
+ * Сначала сравниваем контрольные суммы, которые считает загрузчик
+ * в процессоре; если загрузчик недоступен, сектор сравнивается
+ * точно, через порт отладки. Совпадение сумм подтверждается
+ * последующей проверкой. Возвращает число изменённых секторов.
+ */
+int find_changed_sectors (int n)
 {
-    unsigned addr;
-    int len;
-    int progress_len;
+    target_t *mc = targets [n];
+    unsigned addr, nwords, *data;
+    int len, same, nchanged = 0;
+
+    target_program_begin (mc);
+    for (addr=0; (int)addr<memory_len; addr+=FLASH_BLOCK_SZ) {
+        len = FLASH_BLOCK_SZ;
+        if (memory_len - addr < len)
+            len = memory_len - addr;
+        nwords = (len + 3) / 4;
+        data = (unsigned*) (memory_data + addr);
+        same = target_checksum (mc, memory_base + addr, nwords, data);
+        if (same < 0)
+            same = target_verify_block (mc, memory_base + addr,
+                nwords, data, 0);
+        if (debug_level)
+            fprintf (stderr, "sector %08x: %s\n", memory_base + addr,
+                same ? "unchanged" : "changed");
+        sector_changed [n] [addr / FLASH_BLOCK_SZ] = ! same;
+        if (! same)
+            nchanged++;
+    }
+    target_program_end (mc);
+    return nchanged;
+}
+
+/*
+ * Можно ли не трогать сектор процессора n, содержащий данный
+ * адрес образа.
+ */
+int sector_unchanged (int n, unsigned addr)
+{
+    return diff_mode && ! sector_changed [n] [addr / FLASH_BLOCK_SZ];
+}
+
+/*
+ * Префикс сообщений о процессоре n, если их несколько.
+ */
+void print_target (int n)
+{
+    if (ntargets > 1)
+        printf (_("Processor %d: "), n);
+}
+
+/*
+ * Проверка, что сектор основной flash-памяти стёрт: по контрольной
+ * сумме загрузчика или, если он не запущен, через порт отладки.
+ */
+int sector_blank (target_t *mc, unsigned addr)
+{
+    static unsigned blank [FLASH_BLOCK_SZ/4];
+    int same;
+
+    if (blank[0] == 0)
+        memset (blank, 0xFF, sizeof (blank));
+    same = target_checksum (mc, addr, FLASH_BLOCK_SZ/4, blank);
+    if (same < 0)
+        same = target_verify_block (mc, addr, FLASH_BLOCK_SZ/4, blank, 0);
+    return same;
+}
+
+/*
+ * Выбор способа стирания основной flash-памяти.
+ * Стёртые и неизменные (--diff) секторы образа не стираются,
+ * остальные отмечаются в sector_dirty[]. Если таких секторов много,
+ * а память вне образа чистая, всю память дешевле стереть разом.
+ * Время стирания берём из документации: задержки выдаёт адаптер
+ * в потоке команд, и от обмена оно почти не зависит. Время
+ * проверки сектора измеряем. Возвращает 1, если выбрано стирание всей памяти.
+ */
+int plan_erase (int n)
+{
+    target_t *mc = targets [n];
+    unsigned addr, flash_addr, flash_end, image_end;
+    unsigned nsectors = 0, nblank = 0, ndirty, nout, first_dirty = 0;
+    unsigned scan_msec, read_msec, sector_msec, mass_msec;
+    int mass = 0;
     void *t0;
-    int cur_len = 0;
-    
-    /* Open and detect the device. */
-    atexit (quit);
-    target = target_open (1);
-    if (! target) {
+
+    /* Какие секторы образа надо стирать. */
+    target_program_begin (mc);
+    t0 = fix_time ();
+    for (addr=0; (int)addr<memory_len; addr+=FLASH_BLOCK_SZ) {
+        sector_dirty [n] [addr / FLASH_BLOCK_SZ] = 0;
+        if (sector_unchanged (n, addr))
+            continue;
+        nsectors++;
+        if (sector_blank (mc, memory_base + addr)) {
+            nblank++;
+            continue;
+        }
+        if (nsectors - nblank == 1)
+            first_dirty = addr;
+        sector_dirty [n] [addr / FLASH_BLOCK_SZ] = 1;
+    }
+    scan_msec = mseconds_elapsed (t0);
+    ndirty = nsectors - nblank;
+
+    /* Время чтения сектора для проверки после стирания. */
+    read_msec = 0;
+    if (ndirty > 1) {
+        t0 = fix_time ();
+        check_erasure (mc, memory_base + first_dirty, 0);
+        read_msec = mseconds_elapsed (t0);
+    }
+    sector_msec = ndirty * (4*PAGE_ERASE_MSEC + read_msec);
+
+    /* Стирание всей памяти: неизменные секторы пришлось бы
+     * записывать заново, поэтому с --diff не рассматривается. */
+    flash_addr = target_main_flash_addr (mc);
+    flash_end = flash_addr + target_main_flash_bytes (mc);
+    image_end = memory_base + (memory_len + FLASH_BLOCK_SZ - 1) /
+        FLASH_BLOCK_SZ * FLASH_BLOCK_SZ;
+    if (ndirty > 1 && ! diff_mode && memory_base >= flash_addr &&
+        image_end <= flash_end && memory_base % FLASH_BLOCK_SZ == 0) {
+        nout = (flash_end - flash_addr - (image_end - memory_base)) /
+            FLASH_BLOCK_SZ;
+        mass_msec = 4*PAGE_ERASE_MSEC + ndirty * read_msec +
+            nout * scan_msec / nsectors;
+        if (debug_level)
+            fprintf (stderr, "erase plan: sectors %u msec, whole flash %u msec\n",
+                sector_msec, mass_msec);
+        if (mass_msec < sector_msec) {
+            /* Данные вне образа стирать нельзя. */
+            mass = 1;
+            for (addr=flash_addr; addr<flash_end; addr+=FLASH_BLOCK_SZ) {
+                if (addr >= memory_base && addr < image_end)
+                    continue;
+                if (! sector_blank (mc, addr)) {
+                    print_target (n);
+                    printf (_("Flash is not blank at %08X, erasing by sectors\n"),
+                        addr);
+                    mass = 0;
+                    break;
+                }
+            }
+            if (mass)
+                sector_msec = mass_msec;
+        }
+    }
+    target_program_end (mc);
+
+    print_target (n);
+    if (mass)
+        printf (_("Erase plan: whole flash, estimated %u msec\n"),
+            sector_msec);
+    else if (ndirty > 0)
+        printf (_("Erase plan: %u sectors, estimated %u msec\n"),
+            ndirty, sector_msec);
+    else
+        printf (_("Erase plan: nothing to erase\n"));
+    if (nblank > 0) {
+        print_target (n);
+        printf (_("Already blank: %u sectors\n"), nblank);
+    }
+    return mass;
+}
+
+/*
+ * Открытие процессора номер tap в цепочке JTAG.
+ */
+void open_target (int tap)
+{
+    targets [ntargets] = target_open_tap (1, tap);
+    if (! targets [ntargets]) {
         fprintf (stderr, _("Error detecting device -- check cable!\n"));
         exit (1);
     }
+    ntargets++;
+}
+
+/*
+ * Открытие процессоров, заданных опцией --tap, по умолчанию одного.
+ * Для --tap=all берём все устройства цепочки с тем же
+ * идентификатором JTAG, что и у первого порта отладки ARM.
+ */
+void open_targets ()
+{
+    unsigned idcode [MAX_TAPS];
+    int i, n, tap;
+
+    if (! tap_all) {
+        open_target (adapter_tap);
+        for (i=1; i<tap_count; i++)
+            open_target (tap_list [i]);
+        return;
+    }
+    open_target (-1);
+    n = target_chain (targets [0], &tap, idcode);
+    for (i=tap+1; i<n; i++) {
+        if (idcode[i] == idcode[tap])
+            open_target (i);
+    }
+}
+
+/*
+ * Состояние записи сектора в do_program().
+ */
+#define SECTOR_START    0       /* сектор ещё не начат */
+#define SECTOR_ERASE    1       /* сектор ждёт стирания */
+#define SECTOR_PROGRAM  2       /* сектор стёрт, можно записывать */
+
+/*
+ * Шаг записи очередного сектора процессора n: sector - смещение
+ * сектора в образе, state - состояние. Стирание сектора ждёт, пока
+ * загрузчик запишет предыдущие, и выполняется в erase_sectors(),
+ * а запись передаётся загрузчику без ожидания. Индикатор выполнения
+ * ведётся по первому процессору.
+ * Возвращает 0, если процессор занят.
+ */
+int program_step (int n, unsigned *sector, int *state, int info_flash)
+{
+    target_t *mc = targets [n];
+    unsigned addr = *sector;
+    int len;
+
+    switch (*state) {
+    case SECTOR_START:
+        if (sector_unchanged (n, addr)) {
+            if (n == 0)
+                progress ();
+            *sector += FLASH_BLOCK_SZ;
+            return 1;
+        }
+        if (! sector_dirty [n] [addr / FLASH_BLOCK_SZ]) {
+            *state = SECTOR_PROGRAM;
+            return 1;
+        }
+        if (! target_program_idle (mc))
+            return 0;
+        *state = SECTOR_ERASE;
+        return 1;
+
+    case SECTOR_ERASE:
+        return 0;
+
+    case SECTOR_PROGRAM:
+        for (; addr < *sector + FLASH_BLOCK_SZ &&
+            (int)addr < memory_len; addr += BLOCKSZ) {
+            len = BLOCKSZ;
+            if (memory_len - addr < len)
+                len = memory_len - addr;
+            program_block (mc, addr, len, info_flash);
+        }
+        if (n == 0)
+            progress ();
+        *sector += FLASH_BLOCK_SZ;
+        *state = SECTOR_START;
+        return 1;
+    }
+    return 1;
+}
+
+/*
+ * Стирание секторов всех процессоров, ждущих стирания. Паузы
+ * выдаёт адаптер в потоке команд, общие для всех процессоров,
+ * так что время стирания выдерживается точно. Возвращает 0,
+ * если стирать нечего.
+ */
+int erase_sectors (unsigned *sector, int *state)
+{
+    target_t *mc [MAX_TAPS];
+    unsigned addr [MAX_TAPS];
+    int i, n = 0, index [MAX_TAPS];
+
+    for (i=0; i<ntargets; i++) {
+        if (state [i] != SECTOR_ERASE)
+            continue;
+        mc [n] = targets [i];
+        addr [n] = memory_base + sector [i];
+        index [n++] = i;
+    }
+    if (n == 0)
+        return 0;
+    target_erase_blocks (n, mc, addr);
+    for (i=0; i<n; i++)
+        if (check_erasure (mc [i], addr [i], 0))
+            state [index [i]] = SECTOR_PROGRAM;
+    return 1;
+}
+
+/*
+ * Программирование одного или нескольких процессоров цепочки JTAG.
+ * Стирание и запись идут по секторам, поочерёдно для всех процессоров:
+ * секторы стираются у всех процессоров сразу, а пока загрузчик одного
+ * записывает буфер, адаптер обслуживает остальных.
+ */
+void do_program (char *filename, int info_flash)
+{
+    unsigned addr, sector [MAX_TAPS];
+    int state [MAX_TAPS];
+    int i, len, progress_len, busy, ready, nsectors, nchanged, mass;
+    void *t0;
+
+    /* Open and detect the device. */
+    atexit (quit);
+    open_targets ();
     if (memory_base == ~0)
-        memory_base = target_main_flash_addr (target);
+        memory_base = target_main_flash_addr (targets [0]);
 
     printf (_("Memory: %08X-%08X, total %d bytes\n"), memory_base,
         memory_base + memory_len, memory_len);
 
-    printf (_("Processor: %s\n"), target_cpu_name (target));
-    printf (_("Main flash memory: %d kbytes\n"), target_main_flash_bytes (target) / 1024);
-    printf (_("Info flash memory: %d kbytes\n"), target_info_flash_bytes (target) / 1024);
+    if (ntargets == 1) {
+        printf (_("Processor: %s\n"), target_cpu_name (targets [0]));
+        printf (_("Main flash memory: %d kbytes\n"), target_main_flash_bytes (targets [0]) / 1024);
+        printf (_("Info flash memory: %d kbytes\n"), target_info_flash_bytes (targets [0]) / 1024);
+    } else {
+        for (i=0; i<ntargets; i++)
+            printf (_("Processor %d: %s\n"), i, target_cpu_name (targets [i]));
+    }
 
+    /* Информационная память стирается целиком, сравнивать нет смысла. */
+    if (info_flash || verify_only)
+        diff_mode = 0;
+    if (diff_mode) {
+        nsectors = (memory_len + FLASH_BLOCK_SZ - 1) / FLASH_BLOCK_SZ;
+        for (i=0; i<ntargets; i++) {
+            nchanged = find_changed_sectors (i);
+            print_target (i);
+            printf (_("Sectors: %d changed, %d unchanged\n"),
+                nchanged, nsectors - nchanged);
+        }
+    }
     if (! verify_only) {
-        /* Erase flash. */
-        if (info_flash)
-	    target_erase (target, memory_base, info_flash);
-	else
-	    while (cur_len < memory_len) {
-	        printf (_("Erase address: %08X"), memory_base + cur_len);
-	        fflush(stdout);
-	        do target_erase_block (target, memory_base + cur_len);
-	        while (!check_erasure (target, memory_base + cur_len, info_flash));
-	        cur_len += FLASH_BLOCK_SZ;
-	        printf(_("\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b"));
-	    }
-	    printf("\n");
-	    /*
-	    cur_len = 0;
-	    while (cur_len < memory_len) {
-	        check_erasure (target, memory_base + cur_len, info_flash);
-	        cur_len += FLASH_BLOCK_SZ;
-	    }
-	    */
+        /* Erase flash. Секторы основной памяти стираются
+         * по мере записи, здесь - только память целиком. */
+        for (i=0; i<ntargets; i++) {
+            if (info_flash) {
+                target_erase (targets [i], memory_base, info_flash);
+                continue;
+            }
+            mass = plan_erase (i);
+            if (! mass)
+                continue;
+            target_erase (targets [i], memory_base, 0);
+            for (addr=0; (int)addr<memory_len; addr+=FLASH_BLOCK_SZ) {
+                if (sector_dirty [i] [addr / FLASH_BLOCK_SZ] &&
+                    check_erasure (targets [i], memory_base + addr, 0))
+                    sector_dirty [i] [addr / FLASH_BLOCK_SZ] = 0;
+            }
+        }
     }
     for (progress_step=1; ; progress_step<<=1) {
         progress_len = 1 + memory_len / progress_step / BLOCKSZ;
@@ -452,56 +812,66 @@ void do_program (char *filename, int info_flash)
     progress_count = 0;
     t0 = fix_time ();
     if (! verify_only) {
-	printf (_("Program: "));
+        printf (_("Program: "));
         print_symbols ('.', progress_len);
         print_symbols ('\b', progress_len);
         fflush (stdout);
+        for (i=0; i<ntargets; i++) {
+            target_program_begin (targets [i]);
+            sector [i] = 0;
+            state [i] = SECTOR_START;
+        }
+        do {
+            busy = ready = 0;
+            for (i=0; i<ntargets; i++) {
+                if ((int) sector [i] >= memory_len)
+                    continue;
+                busy = 1;
+                if (program_step (i, &sector [i], &state [i], info_flash))
+                    ready = 1;
+            }
+            if (erase_sectors (sector, state))
+                ready = 1;
+            if (busy && ! ready)
+                mdelay (1);
+        } while (busy);
+        for (i=0; i<ntargets; i++)
+            target_program_end (targets [i]);
+        printf (_("# done\n"));
+        for (i=0; i<ntargets; i++) {
+            if (target_skipped_words (targets [i]) == 0)
+                continue;
+            print_target (i);
+            printf (_("Skipped %u erased words\n"),
+                target_skipped_words (targets [i]));
+        }
+    }
+
+    /* Сброс процессоров перед проверкой. */
+    quit ();
+    open_targets ();
+
+    for (i=0; i<ntargets; i++) {
+        if (ntargets == 1)
+            printf (_("Verify:  "));
+        else
+            printf (_("Verify %d:"), i);
+        print_symbols ('.', progress_len);
+        print_symbols ('\b', progress_len);
+        fflush (stdout);
+        progress_count = 0;
         for (addr=0; (int)addr<memory_len; addr+=BLOCKSZ) {
             len = BLOCKSZ;
             if (memory_len - addr < len)
                 len = memory_len - addr;
-            if (! verify_only) {
-                while (1) {
-                    program_block (target, addr, len, info_flash);
-                    break;
-                    if (! verify_block (target, addr, len, info_flash)) {
-               	        do target_erase_block (target, memory_base + addr);
-	                    while (!check_erasure (target, memory_base + addr, info_flash));
-	                } else {
-	                    break;
-	                }
-	            }
-	        }
             progress ();
+            if (! verify_block (targets [i], addr, len, info_flash))
+                exit (0);
         }
         printf (_("# done\n"));
     }
-
-    target_close (target);
-    free (target);
-
-    target = target_open (1);
-    if (! target) {
-        fprintf (stderr, _("Error detecting device -- check cable!\n"));
-        exit (1);
-    }
-
-    printf (_("Verify:  "));
-    print_symbols ('.', progress_len);
-    print_symbols ('\b', progress_len);
-    fflush (stdout);
-
-    for (addr=0; (int)addr<memory_len; addr+=BLOCKSZ) {
-        len = BLOCKSZ;
-        if (memory_len - addr < len)
-            len = memory_len - addr;
-        progress ();
-        if (! verify_block (target, addr, len, info_flash))
-            exit (0);
-    }
-    printf (_("# done\n"));
     printf (_("Rate: %ld bytes per second\n"),
-        memory_len * 1000L / mseconds_elapsed (t0));
+        memory_len * 1000L * ntargets / mseconds_elapsed (t0));
 }
 
 void do_write ()
@@ -705,13 +1075,20 @@ static void gpl_show_warranty (void)
 int main (int argc, char **argv)
 {
     int ch, read_mode = 0, memory_write_mode = 0, erase_mode = 0;
-    int info_flash = 0;
+    int info_flash = 0, calibrate_mode = 0;
+    char *p, *q;
     //unsigned erase_addr = 0;
     static const struct option long_options[] = {
         { "help",        0, 0, 'h' },
         { "warranty",    0, 0, 'W' },
         { "copying",     0, 0, 'C' },
         { "version",     0, 0, 'V' },
+        { "speed",       1, 0, 'S' },
+        { "calibrate",   0, 0, 'K' },
+        { "swd",         0, 0, 'T' },
+        { "chain",       1, 0, 'J' },
+        { "tap",         1, 0, 'P' },
+        { "diff",        0, 0, 'F' },
         { NULL,          0, 0, 0 },
     };
 
@@ -740,7 +1117,7 @@ int main (int argc, char **argv)
 #endif
     signal (SIGTERM, interrupted);
 
-    while ((ch = getopt_long (argc, argv, "vDhrweiCVW",
+    while ((ch = getopt_long (argc, argv, "vDhrweiCVWS:",
       long_options, 0)) != -1) {
         switch (ch) {
         case 'v':
@@ -762,6 +1139,46 @@ int main (int argc, char **argv)
         case 'i':
             ++info_flash;
             continue;
+        case 'S':
+            adapter_speed = strtoul (optarg, 0, 0);
+            if (adapter_speed <= 0)
+                goto usage;
+            continue;
+        case 'K':
+            ++calibrate_mode;
+            continue;
+        case 'T':
+            adapter_swd = 1;
+            continue;
+        case 'F':
+            ++diff_mode;
+            continue;
+        case 'J':
+            /* Длины регистров команд, начиная с ближайшего к TDO. */
+            for (p=optarg; *p; p=q+(*q==',')) {
+                if (adapter_chain_len >= MAX_TAPS)
+                    goto usage;
+                adapter_irlen [adapter_chain_len] = strtoul (p, &q, 0);
+                if (q == p || adapter_irlen [adapter_chain_len] < 2)
+                    goto usage;
+                adapter_chain_len++;
+            }
+            continue;
+        case 'P':
+            if (strcmp (optarg, "all") == 0) {
+                tap_all = 1;
+                continue;
+            }
+            for (p=optarg; *p; p=q+(*q==',')) {
+                if (tap_count >= MAX_TAPS)
+                    goto usage;
+                tap_list [tap_count] = strtoul (p, &q, 0);
+                if (q == p)
+                    goto usage;
+                tap_count++;
+            }
+            adapter_tap = tap_list [0];
+            continue;
         case 'h':
             break;
         case 'V':
@@ -790,6 +1207,8 @@ usage:
         printf ("       milprog -w [-v] file.srec\n");
         printf ("       milprog -w [-v] file.hex\n");
         printf ("       milprog -w [-v] file.bin [address]\n");
+        printf ("\nCalibrate JTAG clock for this adapter:\n");
+        printf ("       milprog --calibrate\n");
         printf ("\nRead memory:\n");
         printf ("       milprog -r file.bin address length\n");
         printf ("\nArgs:\n");
@@ -803,6 +1222,12 @@ usage:
         printf ("       -e                  Erase all\n");
         printf ("       -i                  Use info flash instead of main\n");
         printf ("       -D                  Debug mode\n");
+        printf ("       -S, --speed=KHZ     JTAG clock frequency in kHz\n");
+        printf ("       --calibrate         Find and save the fastest reliable JTAG clock\n");
+        printf ("       --swd               Use SWD instead of JTAG (ARM-JTAG-SWD adapter)\n");
+        printf ("       --chain=N,N,...     IR lengths of JTAG chain devices, from TDO side\n");
+        printf ("       --tap=N,...|all     Processors in JTAG chain to work with\n");
+        printf ("       --diff              Erase and program only changed sectors\n");
         printf ("       -h, --help          Print this help message\n");
         printf ("       -V, --version       Print version\n");
         printf ("       -C, --copying       Print copying information\n");
@@ -816,7 +1241,9 @@ usage:
 
     switch (argc) {
     case 0:
-        if (erase_mode) {
+        if (calibrate_mode) {
+            do_calibrate ();
+        } else if (erase_mode) {
             //do_erase_block (erase_addr);
             do_erase_all ();
             break;
@@ -18,6 +18,7 @@
 #include <string.h>
 #include <stdarg.h>
 #include <time.h>
+#include <sys/time.h>
 #include <unistd.h>
 #include <errno.h>
 
@@ -33,6 +34,19 @@ struct _target_t {
     unsigned    main_flash_addr;
     unsigned    main_flash_bytes;
     unsigned    info_flash_bytes;
+    unsigned    sram_addr;
+    unsigned    sram_bytes;
+    unsigned    ctl;            /* значение DP_CTRL_STAT без флагов ошибок */
+    int         pushed_verify;  /* порт отладки поддерживает pushed verify */
+    int         loader;         /* загрузчик в ОЗУ: -1 - недоступен, 0 - не загружен,
+                                 * 1 - остановлен, 2 - работает */
+    int         loader_slot;    /* буфер для следующего задания */
+    struct {
+        unsigned addr, nwords, *data;
+        int info_flash;
+    } loader_job [2];           /* задания, переданные загрузчику */
+    unsigned long long loader_start; /* время передачи последнего задания */
+    unsigned    skipped_words;  /* не записанные слова FFFFFFFF */
 };
 
 #if defined (__CYGWIN32__) || defined (MINGW32)
@@ -55,6 +69,126 @@ void mdelay (unsigned msec)
 }
 #endif
 
+/*
+ * Текущее время в микросекундах, для измерения скорости обмена
+ * и отсчёта времени стирания.
+ */
+static unsigned long long usec_now (void)
+{
+    struct timeval tv;
+
+    gettimeofday (&tv, 0);
+    return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+/*
+ * Регистры EEPROM_CMD, EEPROM_ADR, EEPROM_DI и EEPROM_DO лежат в одном
+ * выровненном 16-байтном окне, поэтому к ним можно обращаться через
+ * банк регистров BD0-BD3 блока MEM-AP. Адрес окна заносится в TAR;
+ * адаптер пропускает повторную запись того же адреса и сам
+ * переключает DP_SELECT, так что каждое обращение к регистру
+ * EEPROM занимает одну транзакцию вместо двух.
+ */
+static void eeprom_bank (target_t *t)
+{
+    t->adapter->mem_ap_write (t->adapter, MEM_AP_TAR, EEPROM_CMD);
+}
+
+static void eeprom_write (target_t *t, unsigned reg, unsigned data)
+{
+    if (debug_level) {
+        fprintf (stderr, _("word write %08x to %08x\n"), data, reg);
+    }
+    eeprom_bank (t);
+    t->adapter->mem_ap_write (t->adapter,
+        MEM_AP_BD0 + (reg - EEPROM_CMD), data);
+}
+
+/*
+ * Отложенное чтение регистра EEPROM: значение будет занесено
+ * по адресу data при вызове flush().
+ */
+static void eeprom_queue_read (target_t *t, unsigned reg, unsigned *data)
+{
+    eeprom_bank (t);
+    t->adapter->mem_ap_queue_read (t->adapter,
+        MEM_AP_BD0 + (reg - EEPROM_CMD), data);
+}
+
+/*
+ * Выполнение накопленных транзакций. Возвращает 0, если порт
+ * отладки отбросил часть записей (ответ WAIT при включённом
+ * обнаружении переполнения) и последовательность надо повторить.
+ */
+static int target_flush (target_t *t)
+{
+    t->adapter->flush (t->adapter);
+    return ! t->adapter->stalled;
+}
+
+/*
+ * Восстановление контроллера EEPROM после сбоя последовательности:
+ * записи после сбоя отброшены, и высокое напряжение могло остаться
+ * включённым. Снимаем ERASE, PROG и YE, затем XE, NVSTR и MAS1,
+ * с положенными паузами, и оставляем в EEPROM_CMD значение con.
+ */
+static void eeprom_recover (target_t *t, unsigned con)
+{
+    unsigned retry, cmd = 0;
+
+    for (retry=0; retry<10; retry++) {
+        target_write_word (t, EEPROM_KEY, 0x8AAA5551); // enable access to EEPROM registers
+        cmd = target_read_word (t, EEPROM_CMD);
+        if (t->adapter->stalled)
+            continue;
+        if (debug_level)
+            fprintf (stderr, "flash sequence dropped, CMD = %08x\n", cmd);
+        if (cmd & (EEPROM_CMD_ERASE | EEPROM_CMD_PROG | EEPROM_CMD_YE)) {
+            eeprom_write (t, EEPROM_CMD, cmd & ~(EEPROM_CMD_ERASE |
+                EEPROM_CMD_PROG | EEPROM_CMD_YE));
+            t->adapter->delay (t->adapter, 100);        // Tnvh1 100 us
+        }
+        eeprom_write (t, EEPROM_CMD, cmd & (EEPROM_CMD_CON |
+            EEPROM_CMD_IFREN | EEPROM_CMD_DELAY_MASK)); // clear XE, NVSTR, MAS1
+        t->adapter->delay (t->adapter, 10);             // Trcv 10 us
+        eeprom_write (t, EEPROM_CMD, con);
+        if (target_flush (t))
+            return;
+    }
+    fprintf (stderr, _("Flash controller does not respond, CMD = %08x\n"), cmd);
+    t->adapter->close (t->adapter);
+    exit (1);
+}
+
+/*
+ * Проверка последовательности стирания или записи, начатой
+ * в retry-й раз. При сбое контроллер приводится в состояние con,
+ * и возвращается 0: последовательность надо повторить.
+ */
+static int eeprom_done (target_t *t, unsigned con, unsigned addr,
+    unsigned retry)
+{
+    if (target_flush (t))
+        return 1;
+    eeprom_recover (t, con);
+    if (retry >= 10) {
+        fprintf (stderr, _("Flash operation at %08x failed.\n"), addr);
+        t->adapter->close (t->adapter);
+        exit (1);
+    }
+    return 0;
+}
+
+/*
+ * Снятие CON по окончании работы с регистрами EEPROM.
+ */
+static void eeprom_close (target_t *t)
+{
+    eeprom_write (t, EEPROM_CMD, EEPROM_CMD_DELAY_4); // clear CON
+    if (! target_flush (t))
+        eeprom_recover (t, EEPROM_CMD_DELAY_4);
+}
+
 unsigned target_read_word (target_t *t, unsigned address)
 {
     unsigned value;
@@ -84,6 +218,45 @@ void target_write_word (target_t *t, unsigned address, unsigned data)
  * Устанавливаем соединение с адаптером JTAG.
  */
 target_t *target_open (int need_reset)
+{
+    return target_open_tap (need_reset, adapter_tap);
+}
+
+/*
+ * Проверка поддержки режима pushed verify. Поле TRNMODE в ADIv5
+ * необязательно: порт отладки может читать его как ноль и игнорировать
+ * запись, и тогда ожидаемые значения стали бы обычными записями
+ * в память. Проверяем, что режим включился и что заведомо неверное
+ * значение для регистра CPUID (он только для чтения) выставляет
+ * SSTICKYCMP.
+ */
+static int probe_pushed_verify (target_t *t)
+{
+    unsigned stat, mode;
+
+    t->adapter->dp_write (t->adapter, DP_CTRL_STAT, t->ctl |
+        TRNMODE_PUSHED_VERIFY | MASKLANE_ALL);
+    mode = t->adapter->dp_read (t->adapter, DP_CTRL_STAT) &
+        (TRNMODE_PUSHED_VERIFY | TRNMODE_PUSHED_COMPARE);
+    if (mode == TRNMODE_PUSHED_VERIFY) {
+        t->adapter->mem_ap_write (t->adapter, MEM_AP_TAR, CPUID);
+        t->adapter->mem_ap_write (t->adapter, MEM_AP_DRW, ~t->cpuid);
+        stat = t->adapter->dp_read (t->adapter, DP_CTRL_STAT);
+        if (t->adapter->stalled || (stat & (SSTICKYERR | SSTICKYORUN)))
+            stat = 0;
+    } else
+        stat = 0;
+    t->adapter->dp_write (t->adapter, DP_CTRL_STAT,
+        t->ctl | SSTICKYCMP | SSTICKYERR | SSTICKYORUN);
+    t->adapter->flush (t->adapter);
+    return (stat & SSTICKYCMP) != 0;
+}
+
+/*
+ * Соединение с процессором номер tap в цепочке JTAG;
+ * -1 - первый найденный порт отладки ARM.
+ */
+target_t *target_open_tap (int need_reset, int tap)
 {
     target_t *t;
     unsigned idcode;
@@ -97,7 +270,7 @@ target_t *target_open (int need_reset)
     t->cpu_name = "Unknown";
 
     /* Ищем адаптер JTAG: MPSSE. */
-    t->adapter = adapter_open_mpsse ();
+    t->adapter = adapter_open_mpsse (tap);
     if (! t->adapter) {
         fprintf (stderr, _("No JTAG adapter found.\n"));
         exit (-1);
@@ -108,8 +281,8 @@ target_t *target_open (int need_reset)
     if (debug_level)
         fprintf (stderr, "idcode %08X\n", idcode);
 
-    /* Проверяем идентификатор ARM Debug Interface v5. */
-    if (idcode != 0x4ba00477) {
+    /* Проверяем идентификатор ARM Debug Interface v5: JTAG-DP или SW-DP. */
+    if (idcode != IDCODE_JTAG_DP && idcode != IDCODE_SW_DP) {
         /* Device not detected. */
         if (idcode == 0xffffffff || idcode == 0)
             fprintf (stderr, _("No response from device -- check power is on!\n"));
@@ -123,8 +296,12 @@ target_t *target_open (int need_reset)
 	
 	mdelay (1);
 
-    /* Включение питания блока отладки, сброс залипающих ошибок. */
-	unsigned ctl = CSYSPWRUPREQ | CDBGPWRUPREQ | SSTICKYCMP | SSTICKYERR;
+    /* Включение питания блока отладки, сброс залипающих ошибок.
+     * Обнаружение переполнения включено постоянно: записи, отброшенные
+     * после ответа WAIT, адаптер находит по флагу SSTICKYORUN. */
+	unsigned ctl = CSYSPWRUPREQ | CDBGPWRUPREQ | CORUNDETECT |
+	               SSTICKYCMP | SSTICKYERR | SSTICKYORUN;
+	t->ctl = CSYSPWRUPREQ | CDBGPWRUPREQ | CORUNDETECT;
 	unsigned ack;
 
     do {
@@ -204,6 +381,8 @@ target_t *target_open (int need_reset)
         t->main_flash_addr = 0x08000000;
         t->main_flash_bytes = 128*1024;
         t->info_flash_bytes = 4*1024;
+        t->sram_addr = 0x20000000;
+        t->sram_bytes = 32*1024;
         break;
     default:
         /* Device not detected. */
@@ -212,6 +391,11 @@ target_t *target_open (int need_reset)
         exit (1);
     }
 
+    t->pushed_verify = probe_pushed_verify (t);
+    if (debug_level)
+        fprintf (stderr, "pushed verify %s\n",
+            t->pushed_verify ? "supported" : "not supported");
+
     /* Подача тактовой частоты на периферийные блоки. */
     target_write_word (t, PER_CLOCK, 0xFFFFFFFF);
 
@@ -225,6 +409,12 @@ target_t *target_open (int need_reset)
  */
 void target_close (target_t *t)
 {
+    adapter_t *a = t->adapter;
+
+    if (a->stat_wait || a->stat_faults || debug_level)
+        fprintf (stderr, _("JTAG: %u WAIT replies, %u retries, %u faults, %u aborts\n"),
+            a->stat_wait, a->stat_retries, a->stat_faults, a->stat_aborts);
+
     t->adapter->reset_cpu (t->adapter);
 
     /* Пускаем процессор. */
@@ -243,6 +433,29 @@ const char *target_cpu_name (target_t *t)
     return t->cpu_name;
 }
 
+/*
+ * Устройства цепочки JTAG: заносим идентификаторы в массив idcode
+ * (MAX_TAPS элементов), в *tap - номер устройства этого процессора.
+ * Возвращаем число устройств.
+ */
+int target_chain (target_t *t, int *tap, unsigned *idcode)
+{
+    int i;
+
+    for (i=0; i<t->adapter->ntaps; i++)
+        idcode[i] = t->adapter->chain[i];
+    *tap = t->adapter->tap;
+    return t->adapter->ntaps;
+}
+
+/*
+ * Число слов FFFFFFFF, пропущенных при программировании.
+ */
+unsigned target_skipped_words (target_t *t)
+{
+    return t->skipped_words;
+}
+
 unsigned target_idcode (target_t *t)
 {
     return t->cpuid;
@@ -272,12 +485,45 @@ unsigned target_info_flash_bytes (target_t *t)
  */
 static void clear_cache (target_t *t, unsigned addr)
 {
-    unsigned i;
+    unsigned i, data [9];
 
     t->adapter->mem_ap_write (t->adapter, MEM_AP_TAR, addr);
     for (i=0; i<9; i++) {
-        t->adapter->mem_ap_read (t->adapter, MEM_AP_DRW);
+        t->adapter->mem_ap_queue_read (t->adapter, MEM_AP_DRW, &data[i]);
     }
+    t->adapter->flush (t->adapter);
+}
+
+/*
+ * Стирание одной из четырёх страниц всей flash-памяти
+ * (addr = 0, 4, 8, 12).
+ */
+static void erase_mass_page (target_t *t, unsigned con, unsigned addr)
+{
+    eeprom_write (t, EEPROM_DI, ~0);
+    eeprom_write (t, EEPROM_ADR, addr);
+    eeprom_write (t, EEPROM_CMD, con);
+    eeprom_write (t, EEPROM_CMD, con |
+                                      EEPROM_CMD_WR);       // set WR
+    eeprom_write (t, EEPROM_CMD, con);                      // clear WR
+    eeprom_write (t, EEPROM_CMD, con |
+                                      EEPROM_CMD_MAS1 |     // set MAS1
+                                      EEPROM_CMD_XE |       // set XE
+                                      EEPROM_CMD_ERASE);    // set ERASE
+    t->adapter->delay (t->adapter, 5);                      // 5 us
+    eeprom_write (t, EEPROM_CMD, con |
+                                      EEPROM_CMD_MAS1 |
+                                      EEPROM_CMD_XE |
+                                      EEPROM_CMD_ERASE |
+                                      EEPROM_CMD_NVSTR);    // set NVSTR
+    t->adapter->delay (t->adapter, 40000);                  // 40 ms
+    eeprom_write (t, EEPROM_CMD, con |
+                                      EEPROM_CMD_MAS1 |
+                                      EEPROM_CMD_XE |
+                                      EEPROM_CMD_NVSTR);    // clear ERASE
+    t->adapter->delay (t->adapter, 100);                    // 100 us
+    eeprom_write (t, EEPROM_CMD, con);                      // clear XE, NVSTR, MAS1
+    t->adapter->delay (t->adapter, 1);                      // 1 us
 }
 
 /*
@@ -285,7 +531,7 @@ static void clear_cache (target_t *t, unsigned addr)
  */
 int target_erase (target_t *t, unsigned addr, int info_flash)
 {
-    unsigned i;
+    unsigned i, retry;
     unsigned con = EEPROM_CMD_CON;
     if (info_flash) con |= EEPROM_CMD_IFREN;
 
@@ -293,177 +539,1108 @@ int target_erase (target_t *t, unsigned addr, int info_flash)
     else            printf (_("Erase: %08X..."), t->main_flash_addr);
     fflush (stdout);
     target_write_word (t, EEPROM_KEY, 0x8AAA5551);		//enable access to EEPROM registers
-    target_write_word (t, EEPROM_CMD, EEPROM_CMD_CON);  // set CON
-    target_write_word (t, EEPROM_DI, ~0);
+    eeprom_write (t, EEPROM_CMD, EEPROM_CMD_CON);  // set CON
 
     for (i=0; i<16; i+=4) {
-	target_write_word (t, EEPROM_ADR, i);
-	target_write_word (t, EEPROM_CMD, con);
-	target_write_word (t, EEPROM_CMD, con |
-                                          EEPROM_CMD_WR);       // set WR
-	target_write_word (t, EEPROM_CMD, con); 	     	// clear WR
-	target_write_word (t, EEPROM_CMD, con |
-                                          EEPROM_CMD_MAS1 |     // set MAS1
-                                          EEPROM_CMD_XE |       // set XE
-                                          EEPROM_CMD_ERASE);    // set ERASE
-	// mdelay (1);                                             	// 5 us
-	target_write_word (t, EEPROM_CMD, con |
-                                          EEPROM_CMD_MAS1 |
-                                          EEPROM_CMD_XE |
-                                          EEPROM_CMD_ERASE |
-                                          EEPROM_CMD_NVSTR);    // set NVSTR
-	mdelay (40);                                            // 40 ms
-	target_write_word (t, EEPROM_CMD, con |
-                                          EEPROM_CMD_MAS1 |
-                                          EEPROM_CMD_XE |
-                                          EEPROM_CMD_NVSTR);    // clear ERASE
-	// mdelay (1);                                             	// 100 us
-	target_write_word (t, EEPROM_CMD, con);			// clear XE, NVSTR, MAS1
-	// mdelay (1);                                             	// 1 us
-    }
-    target_write_word (t, EEPROM_CMD, EEPROM_CMD_DELAY_4);      // clear CON
+        for (retry=0; ; retry++) {
+            erase_mass_page (t, con, i);
+            if (eeprom_done (t, con, i, retry))
+                break;
+        }
+    }
+    eeprom_close (t);
     clear_cache (t, addr);
     printf (_(" done\n"));
     return 1;
 }
 
+/*
+ * Стирание страницы блока памяти (addr+0, 4, 8, 12 выбирают
+ * четыре страницы блока) делится на две части: запуск, после
+ * которого надо выждать 40 мс, и завершение.
+ */
+static void erase_page_start (target_t *t, unsigned addr)
+{
+    eeprom_write (t, EEPROM_ADR, addr);
+    eeprom_write (t, EEPROM_CMD, EEPROM_CMD_CON);
+    eeprom_write (t, EEPROM_CMD, EEPROM_CMD_CON |
+                                      EEPROM_CMD_WR);       // set WR
+    eeprom_write (t, EEPROM_CMD, EEPROM_CMD_CON);      // clear WR
+    eeprom_write (t, EEPROM_CMD, EEPROM_CMD_CON |
+                                      EEPROM_CMD_XE |       // set XE
+                                      EEPROM_CMD_ERASE);    // set ERASE
+    t->adapter->delay (t->adapter, 5);                      // 5 us
+    eeprom_write (t, EEPROM_CMD, EEPROM_CMD_CON |
+                                      EEPROM_CMD_XE |
+                                      EEPROM_CMD_ERASE |
+                                      EEPROM_CMD_NVSTR);    // set NVSTR
+}
+
+static void erase_page_finish (target_t *t)
+{
+    eeprom_write (t, EEPROM_CMD, EEPROM_CMD_CON |
+                                      EEPROM_CMD_XE |
+                                      EEPROM_CMD_NVSTR);    // clear ERASE
+    t->adapter->delay (t->adapter, 5);                      // 5 us
+    eeprom_write (t, EEPROM_CMD, EEPROM_CMD_CON);      // clear XE, NVSTR
+    t->adapter->delay (t->adapter, 1);                      // 1 us
+}
+
 /*
  * Стирание одного блока памяти
  */
 int target_erase_block (target_t *t, unsigned addr)
 {
-    unsigned i;
+    unsigned i, retry;
 
     //printf (_("Erase block: %08X..."), addr);
     //fflush (stdout);
     // next 2 lines were swapped - S.I
     target_write_word (t, EEPROM_KEY, 0x8AAA5551); // enable access to EEPROM registers
-    target_write_word (t, EEPROM_CMD, EEPROM_CMD_CON);      // set CON
-    target_write_word (t, EEPROM_DI, ~0);
+    eeprom_write (t, EEPROM_CMD, EEPROM_CMD_CON);      // set CON
     for (i=0; i<16; i+=4) {
-        target_write_word (t, EEPROM_ADR, addr + i);
-        target_write_word (t, EEPROM_CMD, EEPROM_CMD_CON);
-        target_write_word (t, EEPROM_CMD, EEPROM_CMD_CON |
-                                          EEPROM_CMD_WR);       // set WR
-        target_write_word (t, EEPROM_CMD, EEPROM_CMD_CON);      // clear WR
-        target_write_word (t, EEPROM_CMD, EEPROM_CMD_CON |
-                                          EEPROM_CMD_XE |       // set XE
-                                          EEPROM_CMD_ERASE);    // set ERASE
-        mdelay (1);                                             // 5 us
-        target_write_word (t, EEPROM_CMD, EEPROM_CMD_CON |
-                                          EEPROM_CMD_XE |
-                                          EEPROM_CMD_ERASE |
-                                          EEPROM_CMD_NVSTR);    // set NVSTR
-        mdelay (50);                                            // 40 ms
-        target_write_word (t, EEPROM_CMD, EEPROM_CMD_CON |
-                                          EEPROM_CMD_XE |
-                                          EEPROM_CMD_NVSTR);    // clear ERASE
-        mdelay (1);                                             // 5 us
-        target_write_word (t, EEPROM_CMD, EEPROM_CMD_CON);      // clear XE, NVSTR
-        mdelay (1);                                             // 1 us
-    }
-    target_write_word (t, EEPROM_CMD, EEPROM_CMD_DELAY_4);      // clear CON
+        for (retry=0; ; retry++) {
+            eeprom_write (t, EEPROM_DI, ~0);
+            erase_page_start (t, addr + i);
+            t->adapter->delay (t->adapter, 40000);              // 40 ms
+            erase_page_finish (t);
+            if (eeprom_done (t, EEPROM_CMD_CON, addr + i, retry))
+                break;
+        }
+    }
+    eeprom_close (t);
     clear_cache (t, addr);
     //printf (_(" done\n"));
     return 1;
 }
 
+/*
+ * Одновременное стирание блоков памяти нескольких процессоров
+ * цепочки: addr[k] - адрес блока процессора t[k]. Процессоры
+ * работают через один адаптер, поэтому страница стирается у всех
+ * сразу, с одной общей паузой 40 мс в потоке команд, и время
+ * стирания выдерживается точно, как в target_erase_block().
+ */
+void target_erase_blocks (int n, target_t **t, unsigned *addr)
+{
+    unsigned i, retry;
+    int k, left, todo [MAX_TAPS];
+
+    for (k=0; k<n; k++) {
+        target_write_word (t[k], EEPROM_KEY, 0x8AAA5551); // enable access to EEPROM registers
+        eeprom_write (t[k], EEPROM_CMD, EEPROM_CMD_CON);      // set CON
+    }
+    for (i=0; i<16; i+=4) {
+        for (k=0; k<n; k++)
+            todo [k] = 1;
+        for (retry=0; ; retry++) {
+            for (k=0; k<n; k++) {
+                if (! todo [k])
+                    continue;
+                eeprom_write (t[k], EEPROM_DI, ~0);
+                erase_page_start (t[k], addr[k] + i);
+            }
+            t[0]->adapter->delay (t[0]->adapter, 40000);        // 40 ms
+            for (k=0; k<n; k++)
+                if (todo [k])
+                    erase_page_finish (t[k]);
+
+            /* Страницу повторяем только у процессоров со сбоем. */
+            left = 0;
+            for (k=0; k<n; k++) {
+                if (! todo [k])
+                    continue;
+                if (eeprom_done (t[k], EEPROM_CMD_CON, addr[k] + i, retry))
+                    todo [k] = 0;
+                else
+                    left++;
+            }
+            if (! left)
+                break;
+        }
+    }
+    for (k=0; k<n; k++) {
+        eeprom_close (t[k]);
+        clear_cache (t[k], addr[k]);
+    }
+}
+
+/*
+ * Строка flash-памяти: адрес ADR[16:9] выдаётся по сигналу XE, адрес
+ * слова ADR[8:2] - по YE. Слова одной строки одного сектора (ADR[3:2])
+ * программируются при однократной установке XE, PROG и NVSTR: для
+ * каждого слова меняются только ADR и DI и подаётся импульс YE.
+ * Строка одного сектора - 32 слова с шагом 16 байт.
+ */
+#define ROW_BYTES       512
+
+/*
+ * Суммарное время высокого напряжения Thv (от NVSTR до снятия PROG)
+ * не должно превышать 4 мсек. Через JTAG на каждое слово, кроме Tprog,
+ * уходят четыре транзакции, около 45 тактов TCK каждая, так что на
+ * низкой частоте строка целиком за 4 мсек не успевает. Число слов
+ * за одну установку NVSTR ограничивается по частоте TCK, а после
+ * каждой серии пакет отправляется в адаптер, чтобы серия не
+ * разрывалась между передачами USB.
+ */
+#define THV_USEC        4000
+#define WORD_TCK        (4 * 45)
+
+static unsigned hv_burst (target_t *t)
+{
+    unsigned khz = t->adapter->tck_khz, word_usec, n;
+
+    if (khz == 0)
+        return 1;
+    word_usec = 30 + (WORD_TCK * 1000 + khz - 1) / khz;     // Tprog + scans
+    n = (THV_USEC - 10 - 5) / word_usec;                    // minus Tpgs, Tpgh
+    if (n < 1)
+        n = 1;
+    if (n > ROW_BYTES/16)
+        n = ROW_BYTES/16;
+    return n;
+}
+
+/*
+ * Слова блока [addr, end), попадающие в строку сектора, которая
+ * начинается с адреса *first. Адрес *first сдвигается на первое
+ * такое слово; возвращается их количество.
+ */
+static unsigned row_words (unsigned addr, unsigned end, unsigned *first)
+{
+    unsigned last = (*first & ~(ROW_BYTES-1)) + ROW_BYTES;
+
+    if (*first < addr)
+        *first += (addr - *first + 15) & ~15;
+    if (last > end)
+        last = end;
+    if (*first >= last)
+        return 0;
+    return (last - *first + 15) / 16;
+}
+
+/*
+ * Информационная flash-память читается через регистры EEPROM по тем же
+ * строкам, что и программируется: адрес строки сектора ADR[16:9]
+ * и ADR[3:2] выдаётся по сигналу XE один раз, затем для каждого слова
+ * меняется ADR[8:4] и подаётся импульс YE при включённом усилителе
+ * считывания. Все чтения выполняются одним пакетом. Возвращает 0,
+ * если порт отладки отбросил часть транзакций.
+ */
+static int read_info (target_t *t, unsigned addr,
+    unsigned nwords, unsigned *data)
+{
+    unsigned i, row, sector, first, n, end = addr + nwords*4;
+    unsigned con = EEPROM_CMD_CON | EEPROM_CMD_IFREN;
+    unsigned sel = con | EEPROM_CMD_XE | EEPROM_CMD_SE;
+
+    target_write_word (t, EEPROM_KEY, 0x8AAA5551); // enable access to EEPROM registers
+    eeprom_write (t, EEPROM_CMD, con);
+
+    for (row = addr & ~(ROW_BYTES-1); row < end; row += ROW_BYTES) {
+        for (sector=0; sector<16; sector+=4) {
+            first = row + sector;
+            n = row_words (addr, end, &first);
+            if (n == 0)
+                continue;
+            eeprom_write (t, EEPROM_ADR, first);
+            eeprom_write (t, EEPROM_CMD, sel);              // set XE, SE
+            for (i=0; i<n; i++) {
+                eeprom_write (t, EEPROM_ADR, first + i*16);
+                eeprom_write (t, EEPROM_CMD, sel | EEPROM_CMD_YE); // set YE
+                eeprom_queue_read (t, EEPROM_DO,
+                    &data [(first - addr) / 4 + i*4]);
+                eeprom_write (t, EEPROM_CMD, sel);          // clear YE
+            }
+            eeprom_write (t, EEPROM_CMD, con);              // clear XE, SE
+        }
+    }
+    eeprom_write (t, EEPROM_CMD, EEPROM_CMD_DELAY_4);       // clear CON
+    return target_flush (t);
+}
+
 /*
  * Чтение данных из памяти.
+ * Основная flash-память, ОЗУ и периферия отображены в адресное
+ * пространство и читаются напрямую через MEM-AP с автоинкрементом
+ * адреса. Информационная flash-память доступна только через
+ * регистры EEPROM.
  */
 void target_read_block (target_t *t, unsigned addr,
     unsigned nwords, unsigned *data, int info_flash)
 {
 //fprintf (stderr, "target_read_block (addr = %x, nwords = %d)\n", addr, nwords);
-    unsigned con = EEPROM_CMD_CON;
-    if (info_flash) {
-        con |= EEPROM_CMD_IFREN;
+    if (! info_flash) {
+        unsigned retry;
+
+        /* Ответ WAIT означает, что часть слов не прочитана. */
+        for (retry=0; ; retry++) {
+            t->adapter->read_data (t->adapter, addr, nwords, data);
+            if (! t->adapter->stalled)
+                return;
+            if (retry >= 10) {
+                fprintf (stderr, _("Read from %08x failed.\n"), addr);
+                t->adapter->close (t->adapter);
+                exit (1);
+            }
+        }
     }
-    
-    target_write_word (t, EEPROM_KEY, 0x8AAA5551); // enable access to EEPROM registers
-    target_write_word (t, EEPROM_CMD, con);
 
-	int i;
-    for (i=0; i<nwords; i++) {
-        target_write_word (t, EEPROM_ADR, addr + i*4);
-        target_write_word (t, EEPROM_CMD, con | EEPROM_CMD_XE | 
-                                          EEPROM_CMD_YE | EEPROM_CMD_SE);
-        data [i] = target_read_word (t, EEPROM_DO);
-        target_write_word (t, EEPROM_CMD, con);
+    /* Значения EEPROM_DO зависят от предшествующих записей,
+     * поэтому при сбое повторяется весь пакет. */
+    unsigned retry;
+
+    for (retry=0; ! read_info (t, addr, nwords, data); retry++) {
+        eeprom_recover (t, EEPROM_CMD_DELAY_4);
+        if (retry >= 10) {
+            fprintf (stderr, _("Read from %08x failed.\n"), addr);
+            t->adapter->close (t->adapter);
+            exit (1);
+        }
     }
-    target_write_word (t, EEPROM_CMD, EEPROM_CMD_DELAY_4);          // clear CON
 }
 
+/*
+ * Запись блока памяти потоком транзакций: обнаружение переполнения
+ * включено, поэтому транзакции посылаются без проверки ответа ACK.
+ * Если одна из них получила WAIT, все последующие отбрасываются
+ * и выставляется флаг SSTICKYORUN; адаптер проверяет его при flush().
+ * Состояние проверяется на границах 1 кбайта; при сбое
+ * кусок пишется заново.
+ */
 void target_write_block (target_t *t, unsigned addr,
     unsigned nwords, unsigned *data)
 {
-    unsigned i;
+    unsigned i, n, retry;
 
-    t->adapter->mem_ap_write (t->adapter, MEM_AP_TAR, addr);
-    for (i=0; i<nwords; i++, addr+=4, data++) {
-        if (debug_level) {
-            fprintf (stderr, _("block write %08x to %08x\n"), *data, addr);
+    for (; nwords > 0; nwords -= n, addr += n*4, data += n) {
+        n = (0x400 - (addr & 0x3FF)) / 4;
+        if (n > nwords)
+            n = nwords;
+
+        for (retry=0; ; retry++) {
+            for (i=0; i<n; i++) {
+                /* Адаптер отслеживает автоинкремент TAR и пропускает
+                 * запись, если TAR уже содержит нужный адрес. */
+                t->adapter->mem_ap_write (t->adapter, MEM_AP_TAR, addr + i*4);
+                if (debug_level) {
+                    fprintf (stderr, _("block write %08x to %08x\n"),
+                        data[i], addr + i*4);
+                }
+                t->adapter->mem_ap_write (t->adapter, MEM_AP_DRW, data[i]);
+            }
+            if (target_flush (t))
+                break;
+            if (retry >= 10) {
+                fprintf (stderr, _("Write to %08x failed.\n"), addr);
+                t->adapter->close (t->adapter);
+                exit (1);
+            }
         }
-        t->adapter->mem_ap_write (t->adapter, MEM_AP_DRW, *data);
     }
 }
 
 /*
- * Программирование одной страницы памяти (до 256 слов).
- * Страница должна быть предварительно стёрта.
+ * Запись слова с проверкой: отброшенная запись повторяется.
  */
-void target_program_block (target_t *t, unsigned pageaddr,
+static void write_word_sync (target_t *t, unsigned addr, unsigned word)
+{
+    target_write_block (t, addr, 1, &word);
+}
+
+/*
+ * Сравнение блока памяти (до 256 слов) с образцом путём чтения.
+ */
+static int compare_block (target_t *t, unsigned addr,
+    unsigned nwords, unsigned *data, int info_flash)
+{
+    unsigned buf [256];
+
+    target_read_block (t, addr, nwords, buf, info_flash);
+    return memcmp (buf, data, nwords * sizeof (buf[0])) == 0;
+}
+
+/*
+ * Проверка содержимого памяти без передачи данных в компьютер.
+ * Ожидаемые значения записываются в DRW в режиме pushed verify:
+ * порт отладки сам читает память по адресу TAR, сравнивает и при
+ * несовпадении выставляет SSTICKYCMP. Флаг проверяется раз на 1 кбайт.
+ * Если обмен дал сбой, кусок проверяется обычным чтением; так же
+ * проверяется информационная flash-память, не видимая через MEM-AP,
+ * и вся память, если порт отладки не поддерживает pushed verify.
+ * Возвращает 1 при совпадении, 0 при расхождении.
+ */
+int target_verify_block (target_t *t, unsigned addr,
+    unsigned nwords, unsigned *data, int info_flash)
+{
+    unsigned i, n, stat;
+
+    for (; nwords > 0; nwords -= n, addr += n*4, data += n) {
+        n = (0x400 - (addr & 0x3FF)) / 4;
+        if (n > nwords)
+            n = nwords;
+        if (info_flash || ! t->pushed_verify) {
+            if (! compare_block (t, addr, n, data, info_flash))
+                return 0;
+            continue;
+        }
+
+        t->adapter->dp_write (t->adapter, DP_CTRL_STAT, t->ctl |
+            TRNMODE_PUSHED_VERIFY | MASKLANE_ALL);
+        for (i=0; i<n; i++) {
+            t->adapter->mem_ap_write (t->adapter, MEM_AP_TAR, addr + i*4);
+            t->adapter->mem_ap_write (t->adapter, MEM_AP_DRW, data[i]);
+        }
+        stat = t->adapter->dp_read (t->adapter, DP_CTRL_STAT);
+        if (stat & (SSTICKYCMP | SSTICKYERR | SSTICKYORUN))
+            t->adapter->dp_write (t->adapter, DP_CTRL_STAT,
+                t->ctl | SSTICKYCMP | SSTICKYERR | SSTICKYORUN);
+        else
+            t->adapter->dp_write (t->adapter, DP_CTRL_STAT, t->ctl);
+
+        if (t->adapter->stalled || (stat & (SSTICKYERR | SSTICKYORUN))) {
+            if (debug_level)
+                fprintf (stderr, "pushed verify failed, CTRL/STAT = %08x\n", stat);
+            if (! compare_block (t, addr, n, data, 0))
+                return 0;
+            continue;
+        }
+        if (stat & SSTICKYCMP)
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * Серия программирования слов строки, отмеченных в todo, начиная
+ * с номера *next: не более burst слов при одной установке XE, PROG
+ * и NVSTR. В *next возвращается номер слова после серии.
+ */
+static void program_burst (target_t *t, unsigned con, unsigned addr,
+    unsigned nwords, unsigned *data, unsigned todo, unsigned burst,
+    unsigned *next)
+{
+    unsigned i = *next;
+
+    while (i < nwords && ! (todo & 1u << i))
+        i++;
+    if (i >= nwords) {
+        *next = nwords;
+        return;
+    }
+    eeprom_write (t, EEPROM_ADR, addr + i*16);
+    eeprom_write (t, EEPROM_CMD, con |
+                                  EEPROM_CMD_XE |       // set XE
+                                  EEPROM_CMD_PROG);     // set PROG
+    t->adapter->delay (t->adapter, 5);                      // Tnvs 5 us
+    eeprom_write (t, EEPROM_CMD, con |
+                                  EEPROM_CMD_XE |
+                                  EEPROM_CMD_PROG |
+                                  EEPROM_CMD_NVSTR);    // set NVSTR
+    t->adapter->delay (t->adapter, 10);                     // Tpgs 10 us
+    for (; i<nwords && burst>0; i++) {
+        if (! (todo & 1u << i))
+            continue;
+        eeprom_write (t, EEPROM_ADR, addr + i*16);
+        eeprom_write (t, EEPROM_DI, data [i*4]);
+        eeprom_write (t, EEPROM_CMD, con |
+                                  EEPROM_CMD_XE |
+                                  EEPROM_CMD_PROG |
+                                  EEPROM_CMD_NVSTR |
+                                  EEPROM_CMD_YE);       // set YE
+        t->adapter->delay (t->adapter, 30);                 // Tprog 30 us
+        eeprom_write (t, EEPROM_CMD, con |
+                                  EEPROM_CMD_XE |
+                                  EEPROM_CMD_PROG |
+                                  EEPROM_CMD_NVSTR);    // clear YE
+        burst--;
+    }
+    eeprom_write (t, EEPROM_CMD, con |
+                                  EEPROM_CMD_XE |
+                                  EEPROM_CMD_NVSTR);    // clear PROG
+    t->adapter->delay (t->adapter, 5);                      // Tpgh 5 us
+    eeprom_write (t, EEPROM_CMD, con);                      // clear XE, NVSTR
+    t->adapter->delay (t->adapter, 10);                     // Trcv 10 us
+    *next = i;
+}
+
+/*
+ * Программирование строки из nwords слов, начиная с адреса addr,
+ * с шагом 16 байт; данные берутся через каждые 4 слова.
+ * Слова FFFFFFFF после стирания программировать не нужно;
+ * если вся строка из них, высокое напряжение не подаётся.
+ * Если порт отладки отбросил часть записей, неизвестно, какие слова
+ * успели записаться: строка читается, и повторяются только
+ * недописанные слова.
+ */
+static void program_row (target_t *t, unsigned con, unsigned addr,
+    unsigned nwords, unsigned *data)
+{
+    unsigned i, retry, next, todo = 0, buf [ROW_BYTES/4];
+    unsigned burst = hv_burst (t);
+    int ok;
+
+    while (nwords > 0 && data [0] == 0xFFFFFFFF) {
+        addr += 16;
+        data += 4;
+        nwords--;
+    }
+    while (nwords > 0 && data [(nwords-1) * 4] == 0xFFFFFFFF)
+        nwords--;
+    if (nwords == 0)
+        return;
+    for (i=0; i<nwords; i++)
+        if (data [i*4] != 0xFFFFFFFF)
+            todo |= 1u << i;
+
+    for (retry=0; ; retry++) {
+        ok = 1;
+        for (next=0; next<nwords && ok; ) {
+            program_burst (t, con, addr, nwords, data, todo, burst, &next);
+            ok = target_flush (t);
+        }
+        if (ok)
+            return;
+
+        eeprom_recover (t, EEPROM_CMD_DELAY_4);
+        if (retry >= 3) {
+            fprintf (stderr, _("Flash operation at %08x failed.\n"), addr);
+            t->adapter->close (t->adapter);
+            exit (1);
+        }
+        if (! (con & EEPROM_CMD_IFREN))
+            clear_cache (t, addr);
+        target_read_block (t, addr, (nwords-1)*4 + 1, buf,
+            con & EEPROM_CMD_IFREN);
+        for (i=0; i<nwords; i++) {
+            if (! (todo & 1u << i))
+                continue;
+            if (buf [i*4] == data [i*4]) {
+                todo &= ~(1u << i);
+            } else if ((buf [i*4] & data [i*4]) != data [i*4]) {
+                fprintf (stderr, _("Flash word at %08x is not erased: %08x\n"),
+                    addr + i*16, buf [i*4]);
+                t->adapter->close (t->adapter);
+                exit (1);
+            }
+        }
+        target_write_word (t, EEPROM_KEY, 0x8AAA5551); // enable access to EEPROM registers
+        eeprom_write (t, EEPROM_CMD, con);
+        if (todo == 0)
+            return;
+    }
+}
+
+/*
+ * Программирование блока памяти через регистры контроллера EEPROM,
+ * по строкам. Память должна быть предварительно стёрта.
+ */
+static void program_jtag (target_t *t, unsigned pageaddr,
     unsigned nwords, unsigned *data, int info_flash)
 {
-    unsigned i;
+    unsigned row, sector, first, n, end = pageaddr + nwords*4;
     unsigned con = EEPROM_CMD_CON;
     if (info_flash) {
        con |= EEPROM_CMD_IFREN;
     }
 
     target_write_word (t, EEPROM_KEY, 0x8AAA5551);			// enable register access to EEPROM regs
-    target_write_word (t, EEPROM_CMD, con);		// set CON
+    eeprom_write (t, EEPROM_CMD, con);		// set CON
 
-    for (i=0; i<nwords; i++) {
-        target_write_word (t, EEPROM_ADR, pageaddr + i*4);
-        //mdelay (1);
-	target_write_word (t, EEPROM_CMD, con |
-                                          EEPROM_CMD_XE |	// set XE
-                                          EEPROM_CMD_PROG); // set PROG
-	//mdelay (1);
-	target_write_word (t, EEPROM_CMD, con |
-                                          EEPROM_CMD_XE |
-                                          EEPROM_CMD_PROG |
-                                          EEPROM_CMD_NVSTR);// set NVSTR
-	target_write_word (t, EEPROM_DI, data [i]);
-	target_write_word (t, EEPROM_CMD, con |
-                                          EEPROM_CMD_XE |
-                                          EEPROM_CMD_PROG |
-                                          EEPROM_CMD_NVSTR |
-                                          EEPROM_CMD_WR);   // set WR
-	target_write_word (t, EEPROM_CMD, con |
-                                          EEPROM_CMD_XE |
-                                          EEPROM_CMD_PROG |
-                                          EEPROM_CMD_NVSTR);// clear WR
-	//mdelay (1);
-	target_write_word (t, EEPROM_CMD, con |
-                                          EEPROM_CMD_XE |
-                                          EEPROM_CMD_PROG |
-                                          EEPROM_CMD_NVSTR |
-                                          EEPROM_CMD_YE);	// set YE
-	//mdelay (1);
-	target_write_word (t, EEPROM_CMD, con |
-                                          EEPROM_CMD_XE |
-                                          EEPROM_CMD_PROG |
-                                          EEPROM_CMD_NVSTR);// clear YE
-	target_write_word (t, EEPROM_CMD, con |
-                                          EEPROM_CMD_XE |
-                                          EEPROM_CMD_NVSTR);// clear PROG
-	//mdelay (1);
-        target_write_word (t, EEPROM_CMD, con);	// clear XE, NVSTR
-	//mdelay (1);
-    }
-    target_write_word (t, EEPROM_CMD, EEPROM_CMD_DELAY_4); // clear CON
+    for (row = pageaddr & ~(ROW_BYTES-1); row < end; row += ROW_BYTES) {
+        for (sector=0; sector<16; sector+=4) {
+            first = row + sector;
+            n = row_words (pageaddr, end, &first);
+            if (n > 0)
+                program_row (t, con, first, n,
+                    data + (first - pageaddr) / 4);
+        }
+    }
+    eeprom_close (t);
 
     clear_cache (t, pageaddr);
 }
+
+/*
+ * Загрузчик flash-памяти, исполняемый процессором из ОЗУ.
+ * Загрузчик в цикле обслуживает по очереди два буфера данных:
+ * пока процессор программирует один, адаптер заполняет другой.
+ * Каждому буферу соответствует почтовый ящик из четырёх слов:
+ * команда (0 - буфер свободен), адрес flash-памяти, количество строк
+ * и значение CON или CON|IFREN для регистра EEPROM_CMD.
+ * Буфер содержит строки одна за другой: адрес первого слова, число
+ * слов и сами слова, которые записываются с шагом 16 байт по адресу.
+ * Слова FFFFFFFF уже находятся в стёртом состоянии и пропускаются.
+ * По команде 2 загрузчик считает контрольную сумму участка
+ * основной flash-памяти: адрес и число слов берутся из второго
+ * и третьего слов ящика, туда же записываются сумма слов и сумма
+ * частичных сумм.
+ * Задержки отсчитываются таймером SysTick от частоты HSI 8 МГц.
+ */
+static const unsigned short loader_code[] = {
+    0xf2af, 0x0004,  /* start: adr r0, start */
+    0xf500, 0x7880,  /* add r8, r0, #0x100 ; mailbox slot 0 */
+    0xf500, 0x5980,  /* add r9, r0, #0x1000 ; data buffer 0 */
+    0x4c34,          /* ldr r4, =0x40018000 ; EEPROM_CMD */
+    0x4d35,          /* ldr r5, =0xE000E010 ; SYSTICK_CTRL */
+    0xf8d8, 0x0000,  /* wait: ldr r0, [r8] ; command */
+    0x2800,          /* cmp r0, #0 */
+    0xd0fb,          /* beq wait */
+    0x2802,          /* cmp r0, #2 ; checksum? */
+    0xd00e,          /* beq sum */
+    0x4649,          /* mov r1, r9 ; data */
+    0xf8d8, 0x2008,  /* ldr r2, [r8, #8] ; row count */
+    0xf8d8, 0x300c,  /* ldr r3, [r8, #12] ; CON or CON|IFREN */
+    0xf000, 0xf81a,  /* bl program */
+    0x2000,          /* free: movs r0, #0 */
+    0xf8c8, 0x0000,  /* str r0, [r8] ; slot is free */
+    0xf088, 0x0810,  /* eor r8, r8, #0x10 ; next slot */
+    0xf489, 0x5940,  /* eor r9, r9, #0x3000 ; next buffer */
+    0xe7ea,          /* b wait */
+    0xf8d8, 0x1004,  /* sum: ldr r1, [r8, #4] ; flash address */
+    0xf8d8, 0x2008,  /* ldr r2, [r8, #8] ; word count */
+    0x2600,          /* movs r6, #0 ; sum of words */
+    0x2700,          /* movs r7, #0 ; sum of sums */
+    0xb12a,          /* next: cbz r2, store */
+    0xf851, 0x0b04,  /* ldr r0, [r1], #4 */
+    0x4406,          /* add r6, r0 */
+    0x4437,          /* add r7, r6 */
+    0x3a01,          /* subs r2, #1 */
+    0xe7f8,          /* b next */
+    0xf8c8, 0x6004,  /* store: str r6, [r8, #4] */
+    0xf8c8, 0x7008,  /* str r7, [r8, #8] */
+    0xe7e5,          /* b free */
+    0xb500,          /* program: push {lr} */
+    0x6023,          /* str r3, [r4] ; CMD = con */
+    0xb382,          /* row: cbz r2, done */
+    0xf851, 0x0b04,  /* ldr r0, [r1], #4 ; row address */
+    0xf851, 0xcb04,  /* ldr ip, [r1], #4 ; words in row */
+    0x6060,          /* str r0, [r4, #4] ; ADR */
+    0xf443, 0x5682,  /* orr r6, r3, #0x1040 ; XE | PROG */
+    0x6026,          /* str r6, [r4] */
+    0x2728,          /* movs r7, #40 ; Tnvs 5 us */
+    0xf000, 0xf827,  /* bl delay */
+    0xf446, 0x5600,  /* orr r6, r6, #0x2000 ; NVSTR */
+    0x6026,          /* str r6, [r4] */
+    0x2750,          /* movs r7, #80 ; Tpgs 10 us */
+    0xf000, 0xf821,  /* bl delay */
+    0xf851, 0x7b04,  /* word: ldr r7, [r1], #4 */
+    0xf117, 0x0f01,  /* cmn r7, #1 ; erased value? */
+    0xd00a,          /* beq skip */
+    0x6060,          /* str r0, [r4, #4] ; ADR */
+    0x60a7,          /* str r7, [r4, #8] ; DI */
+    0xf046, 0x0680,  /* orr r6, r6, #0x80 ; YE */
+    0x6026,          /* str r6, [r4] */
+    0x27f0,          /* movs r7, #240 ; Tprog 30 us */
+    0xf000, 0xf814,  /* bl delay */
+    0xf026, 0x0680,  /* bic r6, r6, #0x80 ; clear YE */
+    0x6026,          /* str r6, [r4] */
+    0x3010,          /* skip: adds r0, #16 ; next word of the row */
+    0xf1bc, 0x0c01,  /* subs ip, ip, #1 */
+    0xd1eb,          /* bne word */
+    0xf426, 0x5680,  /* bic r6, r6, #0x1000 ; clear PROG */
+    0x6026,          /* str r6, [r4] */
+    0x2728,          /* movs r7, #40 ; Tpgh 5 us */
+    0xf000, 0xf807,  /* bl delay */
+    0x6023,          /* str r3, [r4] ; clear XE, NVSTR */
+    0x2750,          /* movs r7, #80 ; Trcv 10 us */
+    0xf000, 0xf803,  /* bl delay */
+    0x3a01,          /* subs r2, #1 */
+    0xe7cd,          /* b row */
+    0xbd00,          /* done: pop {pc} */
+    0x3f01,          /* delay: subs r7, #1 ; r7 = HCLK cycles */
+    0x606f,          /* str r7, [r5, #4] ; LOAD */
+    0x2700,          /* movs r7, #0 */
+    0x60af,          /* str r7, [r5, #8] ; VAL */
+    0x2705,          /* movs r7, #5 ; ENABLE | CLKSOURCE */
+    0x602f,          /* str r7, [r5] */
+    0x682f,          /* 1: ldr r7, [r5] */
+    0x03ff,          /* lsls r7, r7, #15 ; COUNTFLAG */
+    0xd5fc,          /* bpl 1b */
+    0x2700,          /* movs r7, #0 */
+    0x602f,          /* str r7, [r5] */
+    0x4770,          /* bx lr */
+    0x8000, 0x4001,  /* .word 0x40018000 */
+    0xe010, 0xe000,  /* .word 0xe000e010 */
+};
+
+#define LOADER_MBOX     0x100           /* смещение почтовых ящиков в ОЗУ */
+#define LOADER_BUF      0x1000          /* смещение первого буфера данных */
+#define LOADER_BUF_SZ   4096            /* размер буфера данных */
+#define LOADER_PROGRAM  1               /* команда: запись flash-памяти */
+#define LOADER_CHECKSUM 2               /* команда: контрольная сумма */
+
+/* Слов данных в буфере: в худшем случае блок из LOADER_WORDS слов
+ * задевает 32 строки, заголовки которых занимают 64 слова. */
+#define LOADER_WORDS    (LOADER_BUF_SZ/4 - 128)
+
+/*
+ * Запись регистра процессора через DCRSR/DCRDR.
+ */
+static int target_write_reg (target_t *t, unsigned regno, unsigned value)
+{
+    unsigned retry;
+
+    unsigned dhcsr;
+
+    target_write_word (t, DCB_DCRDR, value);
+    target_write_word (t, DCB_DCRSR, regno | DCRSR_WnR);
+    for (retry=0; retry<100; retry++) {
+        dhcsr = target_read_word (t, DCB_DHCSR);
+        if (t->adapter->stalled) {
+            /* Записи отброшены портом отладки: повторяем. */
+            target_write_word (t, DCB_DCRDR, value);
+            target_write_word (t, DCB_DCRSR, regno | DCRSR_WnR);
+            continue;
+        }
+        if (dhcsr & S_REGRDY)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Загрузка программы-загрузчика в ОЗУ.
+ * Возвращаем 0, если процессор не поддерживает этот режим.
+ */
+static int loader_install (target_t *t)
+{
+    unsigned i, nwords, code [(sizeof (loader_code) + 3) / 4];
+
+    if (t->sram_bytes < LOADER_BUF + 2*LOADER_BUF_SZ)
+        return 0;
+
+    /* Переключаем процессор на частоту HSI, от неё считаются задержки. */
+    write_word_sync (t, CPU_CLOCK, 0);
+
+    nwords = sizeof (loader_code) / 4;
+    for (i=0; i<nwords; i++)
+        code[i] = loader_code [2*i] | loader_code [2*i+1] << 16;
+    target_write_block (t, t->sram_addr, nwords, code);
+
+    /* Проверяем, что код записался. */
+    for (i=0; i<nwords; i++) {
+        if (target_read_word (t, t->sram_addr + i*4) != code[i]) {
+            if (debug_level)
+                fprintf (stderr, "loader: download failed at %08x\n",
+                    t->sram_addr + i*4);
+            return 0;
+        }
+    }
+    if (debug_level)
+        fprintf (stderr, "loader: %u bytes at %08x\n",
+            nwords * 4, t->sram_addr);
+    return 1;
+}
+
+/*
+ * Ожидание, пока загрузчик выполнит команду в почтовом ящике.
+ * Возвращаем 0, если загрузчик не отвечает.
+ */
+static int loader_idle (target_t *t, unsigned mbox)
+{
+    unsigned retry;
+
+    for (retry=0; target_read_word (t, mbox) != 0; retry++) {
+        if (retry > 1000)
+            return 0;
+        mdelay (1);
+    }
+    return 1;
+}
+
+/*
+ * Ожидание, пока загрузчик освободит буфер.
+ * Возвращаем 0, если загрузчик не отвечает.
+ */
+static int loader_wait (target_t *t, int slot)
+{
+    if (t->loader_job[slot].nwords == 0)
+        return 1;
+    if (! loader_idle (t, t->sram_addr + LOADER_MBOX + slot*16))
+        return 0;
+    t->loader_job[slot].nwords = 0;
+    return 1;
+}
+
+/*
+ * Загрузчик не отвечает: останавливаем процессор и
+ * повторяем незавершённые задания через регистры EEPROM.
+ */
+static void loader_failed (target_t *t)
+{
+    int i, slot;
+
+    fprintf (stderr, _("Flash loader failed, using JTAG\n"));
+    write_word_sync (t, DCB_DHCSR, DBGKEY | C_DEBUGEN | C_HALT | C_MASKINTS);
+    t->loader = -1;
+
+    /* Начинаем с более старого задания. */
+    for (i=0; i<2; i++) {
+        slot = t->loader_slot ^ i;
+        if (t->loader_job[slot].nwords == 0)
+            continue;
+        program_jtag (t, t->loader_job[slot].addr,
+            t->loader_job[slot].nwords, t->loader_job[slot].data,
+            t->loader_job[slot].info_flash);
+        t->loader_job[slot].nwords = 0;
+    }
+}
+
+/*
+ * Раскладка блока по строкам для загрузчика. Возвращаем размер
+ * буфера в словах, в *nrows - число строк.
+ */
+static unsigned loader_pack (unsigned addr, unsigned nwords,
+    unsigned *data, unsigned *packed, unsigned *nrows)
+{
+    unsigned row, sector, first, n, i, len = 0, end = addr + nwords*4;
+
+    *nrows = 0;
+    for (row = addr & ~(ROW_BYTES-1); row < end; row += ROW_BYTES) {
+        for (sector=0; sector<16; sector+=4) {
+            first = row + sector;
+            n = row_words (addr, end, &first);
+
+            /* Стёртые слова в начале и в конце строки не передаём,
+             * внутри строки их пропускает загрузчик. */
+            while (n > 0 && data [(first - addr) / 4] == 0xFFFFFFFF) {
+                first += 16;
+                n--;
+            }
+            while (n > 0 && data [(first - addr) / 4 + (n-1)*4] == 0xFFFFFFFF)
+                n--;
+            if (n == 0)
+                continue;
+            packed [len++] = first;
+            packed [len++] = n;
+            for (i=0; i<n; i++)
+                packed [len++] = data [(first - addr) / 4 + i*4];
+            ++*nrows;
+        }
+    }
+    return len;
+}
+
+/*
+ * Запуск загрузчика перед серией вызовов target_program_next().
+ * Если загрузчик недоступен, программирование идёт через JTAG.
+ */
+void target_program_begin (target_t *t)
+{
+    static unsigned mbox [8];
+
+    if (t->loader == 0)
+        t->loader = loader_install (t) ? 1 : -1;
+    if (t->loader != 1)
+        return;
+
+    write_word_sync (t, EEPROM_KEY, 0x8AAA5551);    // enable access to EEPROM registers
+    target_write_block (t, t->sram_addr + LOADER_MBOX, 8, mbox);
+    if (! target_write_reg (t, DCRSR_SP, t->sram_addr + t->sram_bytes) ||
+        ! target_write_reg (t, DCRSR_PC, t->sram_addr) ||
+        ! target_write_reg (t, DCRSR_XPSR, XPSR_T)) {
+        t->loader = -1;
+        return;
+    }
+
+    /* Пускаем процессор. */
+    write_word_sync (t, DCB_DHCSR, DBGKEY | C_DEBUGEN | C_MASKINTS);
+    t->loader = 2;
+    t->loader_slot = 0;
+}
+
+/*
+ * Программирование блока flash-памяти.
+ * Блок передаётся загрузчику в свободный буфер, и функция
+ * возвращается, не дожидаясь окончания записи.
+ */
+void target_program_next (target_t *t, unsigned addr,
+    unsigned nwords, unsigned *data, int info_flash)
+{
+    unsigned i, n, hdr [3], mbox, buf, len, packed [LOADER_BUF_SZ/4];
+    int slot;
+
+    for (i=0; i<nwords; i++)
+        if (data [i] == 0xFFFFFFFF)
+            t->skipped_words++;
+
+    for (; nwords > 0; nwords -= n, addr += n*4, data += n) {
+        if (t->loader != 2) {
+            program_jtag (t, addr, nwords, data, info_flash);
+            return;
+        }
+        n = nwords;
+        if (n > LOADER_WORDS)
+            n = LOADER_WORDS;
+        len = loader_pack (addr, n, data, packed, &hdr[1]);
+        if (hdr[1] == 0) {
+            /* Всё стёрто, записывать нечего. */
+            continue;
+        }
+
+        /* Ждём, пока загрузчик освободит очередной буфер. */
+        slot = t->loader_slot;
+        if (! loader_wait (t, slot)) {
+            loader_failed (t);
+            program_jtag (t, addr, nwords, data, info_flash);
+            return;
+        }
+        mbox = t->sram_addr + LOADER_MBOX + slot*16;
+        buf = t->sram_addr + LOADER_BUF + slot*LOADER_BUF_SZ;
+        target_write_block (t, buf, len, packed);
+
+        /* Команда записывается последней. */
+        hdr[0] = addr;
+        hdr[2] = info_flash ? EEPROM_CMD_CON | EEPROM_CMD_IFREN :
+                              EEPROM_CMD_CON;
+        target_write_block (t, mbox + 4, 3, hdr);
+        write_word_sync (t, mbox, LOADER_PROGRAM);
+        t->loader_start = usec_now ();
+
+        t->loader_job[slot].addr = addr;
+        t->loader_job[slot].nwords = n;
+        t->loader_job[slot].data = data;
+        t->loader_job[slot].info_flash = info_flash;
+        t->loader_slot = slot ^ 1;
+    }
+}
+
+/*
+ * Проверка без ожидания, выполнил ли загрузчик все задания записи.
+ * Без загрузчика запись идёт синхронно, и всегда возвращается 1.
+ * Если загрузчик не отвечает дольше секунды, задания повторяются
+ * через регистры EEPROM.
+ */
+int target_program_idle (target_t *t)
+{
+    unsigned cmd;
+    int i, slot;
+
+    if (t->loader != 2)
+        return 1;
+    for (i=0; i<2; i++) {
+        slot = t->loader_slot ^ i;
+        if (t->loader_job[slot].nwords == 0)
+            continue;
+        cmd = target_read_word (t, t->sram_addr + LOADER_MBOX + slot*16);
+        if (cmd != 0 || t->adapter->stalled) {
+            if (usec_now () - t->loader_start < 1000000)
+                return 0;
+            loader_failed (t);
+            return 1;
+        }
+        t->loader_job[slot].nwords = 0;
+    }
+    return 1;
+}
+
+/*
+ * Ожидание окончания записи и останов загрузчика.
+ */
+void target_program_end (target_t *t)
+{
+    unsigned addr;
+
+    if (t->loader != 2)
+        return;
+    addr = t->loader_job [t->loader_slot ^ 1].addr;
+    if (! loader_wait (t, t->loader_slot) ||
+        ! loader_wait (t, t->loader_slot ^ 1)) {
+        loader_failed (t);
+        return;
+    }
+    write_word_sync (t, DCB_DHCSR, DBGKEY | C_DEBUGEN | C_HALT | C_MASKINTS);
+    t->loader = 1;
+
+    eeprom_close (t);
+    clear_cache (t, addr);
+}
+
+/*
+ * Сравнение участка основной flash-памяти с данными по контрольной
+ * сумме, которую считает загрузчик: сумма слов и сумма частичных
+ * сумм, как у Флетчера. Вызывается после target_program_begin(),
+ * пока загрузчику не переданы задания записи.
+ * Возвращает 1 при совпадении, 0 при расхождении и -1,
+ * если загрузчик недоступен.
+ */
+int target_checksum (target_t *t, unsigned addr,
+    unsigned nwords, unsigned *data)
+{
+    unsigned i, a, b, mbox, hdr [2];
+    int slot;
+
+    if (t->loader != 2)
+        return -1;
+    slot = t->loader_slot;
+    if (! loader_wait (t, slot)) {
+        loader_failed (t);
+        return -1;
+    }
+    mbox = t->sram_addr + LOADER_MBOX + slot*16;
+    hdr[0] = addr;
+    hdr[1] = nwords;
+    target_write_block (t, mbox + 4, 2, hdr);
+    write_word_sync (t, mbox, LOADER_CHECKSUM);
+    t->loader_slot = slot ^ 1;
+    if (! loader_idle (t, mbox)) {
+        loader_failed (t);
+        return -1;
+    }
+    a = b = 0;
+    for (i=0; i<nwords; i++) {
+        a += data[i];
+        b += a;
+    }
+    return target_read_word (t, mbox + 4) == a &&
+           target_read_word (t, mbox + 8) == b;
+}
+
+/*
+ * Программирование одной страницы памяти.
+ * Страница должна быть предварительно стёрта.
+ */
+void target_program_block (target_t *t, unsigned pageaddr,
+    unsigned nwords, unsigned *data, int info_flash)
+{
+    target_program_begin (t);
+    target_program_next (t, pageaddr, nwords, data, info_flash);
+    target_program_end (t);
+}
+
+#define CAL_WORDS       256             /* размер тестового блока, 1 кбайт */
+#define CAL_PASSES      3               /* сколько раз повторяется проверка */
+
+/*
+ * Проверка обмена на текущей частоте: IDCODE, запись и чтение
+ * DP_CTRL_STAT, запись и чтение блока памяти через MEM-AP.
+ * Возвращает время обмена блоком в микросекундах или 0 при ошибке.
+ * В *rtt заносится время одиночного чтения слова.
+ */
+static unsigned calibrate_test (target_t *t, unsigned salt, unsigned *rtt)
+{
+    adapter_t *a = t->adapter;
+    unsigned pattern [CAL_WORDS], data [CAL_WORDS], addr, stat, idcode, i, n;
+    unsigned long long t0, t1;
+
+    /* Сброс TAP и состояния порта отладки после неудачной попытки. */
+    idcode = a->get_idcode (a);
+    if (idcode != IDCODE_JTAG_DP && idcode != IDCODE_SW_DP)
+        return 0;
+    a->dp_write (a, DP_CTRL_STAT, t->ctl | SSTICKYORUN | SSTICKYERR | SSTICKYCMP);
+    stat = a->dp_read (a, DP_CTRL_STAT);
+    if ((stat & (CDBGPWRUPACK | CSYSPWRUPACK)) != (CDBGPWRUPACK | CSYSPWRUPACK))
+        return 0;
+    a->mem_ap_write (a, MEM_AP_CSW, CSW_HPROT | CSW_32BIT | CSW_ADDRINC_SINGLE);
+
+    /* Время одиночного чтения. */
+    t0 = usec_now ();
+    for (i=0; i<16; i++) {
+        a->mem_ap_write (a, MEM_AP_TAR, DCB_DHCSR);
+        if (! (a->mem_ap_read (a, MEM_AP_DRW) & S_HALT) || a->stalled)
+            return 0;
+    }
+    *rtt = (usec_now () - t0) / 16;
+
+    /* Тестовая последовательность. Если ОЗУ не описано,
+     * используем регистр DCRDR. */
+    for (i=0; i<CAL_WORDS; i++)
+        pattern[i] = ((i & 1) ? 0xAAAAAAAA : 0x55555555) ^
+            (i * 0x01010101) ^ salt;
+    addr = t->sram_bytes ? t->sram_addr : DCB_DCRDR;
+    n = t->sram_bytes ? CAL_WORDS : 16;
+
+    t0 = usec_now ();
+    if (t->sram_bytes) {
+        a->mem_ap_write (a, MEM_AP_TAR, addr);
+        for (i=0; i<n; i++)
+            a->mem_ap_write (a, MEM_AP_DRW, pattern[i]);
+        a->read_data (a, addr, n, data);
+    } else {
+        for (i=0; i<n; i++) {
+            a->mem_ap_write (a, MEM_AP_TAR, addr);
+            a->mem_ap_write (a, MEM_AP_DRW, pattern[i]);
+            a->mem_ap_write (a, MEM_AP_TAR, addr);
+            a->mem_ap_queue_read (a, MEM_AP_DRW, &data[i]);
+        }
+        a->flush (a);
+    }
+    t1 = usec_now ();
+    if (a->stalled || memcmp (pattern, data, n * sizeof (data[0])) != 0)
+        return 0;
+
+    stat = a->dp_read (a, DP_CTRL_STAT);
+    if (stat & (SSTICKYORUN | SSTICKYERR))
+        return 0;
+    return t1 > t0 ? t1 - t0 : 1;
+}
+
+/*
+ * Подбор частоты TCK и таймера задержки адаптера.
+ * Перебираются сочетания от быстрых к медленным, каждое проверяется
+ * несколько раз; самое быстрое надёжное сохраняется в профиле адаптера.
+ */
+int target_calibrate (target_t *t)
+{
+    static const unsigned speed[] = {
+        30000, 20000, 15000, 10000, 7500, 6000, 5000, 3000, 2000, 1000, 500,
+    };
+    static const unsigned latency[] = { 0, 1, 2, 4, 8, 16 };
+    adapter_t *a = t->adapter;
+    unsigned s, l, pass, khz, row_khz, prev_khz = 0, rtt, usec, best_usec = 0;
+    unsigned best_rtt = 0, best_khz = 0, best_latency = 0, bytes;
+
+    if (! a->set_clock || ! a->save_profile) {
+        fprintf (stderr, _("Calibration is not supported by this adapter.\n"));
+        return 0;
+    }
+    bytes = t->sram_bytes ? CAL_WORDS * 4 * 2 : 16 * 4 * 2;
+    for (s=0; s<sizeof(speed)/sizeof(speed[0]); s++) {
+        row_khz = 0;
+        for (l=0; l<sizeof(latency)/sizeof(latency[0]); l++) {
+            khz = a->set_clock (a, speed[s], latency[l]);
+            if (khz == 0)
+                continue;
+            if (khz == prev_khz)
+                break;          /* эта частота уже проверена */
+            row_khz = khz;
+            printf (_("TCK %5u kHz, latency %2u: "), khz, latency[l]);
+            fflush (stdout);
+            usec = ~0;
+            for (pass=0; pass<CAL_PASSES; pass++) {
+                unsigned n = calibrate_test (t, pass * 0x11111111 + l, &rtt);
+                if (n == 0) {
+                    usec = 0;
+                    break;
+                }
+                if (n < usec)
+                    usec = n;
+            }
+            if (usec == 0) {
+                printf (_("failed\n"));
+                continue;
+            }
+            printf (_("%u usec per read, %u kbytes/sec\n"), rtt,
+                (unsigned) (bytes * 1000ULL / usec / 1024));
+            if (best_usec == 0 || usec < best_usec ||
+                (usec == best_usec && rtt < best_rtt)) {
+                best_usec = usec;
+                best_rtt = rtt;
+                best_khz = khz;
+                best_latency = latency[l];
+            }
+        }
+        if (row_khz)
+            prev_khz = row_khz;
+    }
+    if (best_usec == 0) {
+        fprintf (stderr, _("No reliable JTAG clock found -- check cable!\n"));
+        return 0;
+    }
+    a->set_clock (a, best_khz, best_latency);
+    calibrate_test (t, 0, &rtt);
+    a->save_profile (a);
+    printf (_("Saved profile: TCK %u kHz, latency %u\n"), best_khz, best_latency);
+    return 1;
+}
@@ -18,9 +18,11 @@
 typedef struct _target_t target_t;
 
 target_t *target_open (int need_reset);
+target_t *target_open_tap (int need_reset, int tap);
 void target_close (target_t *mc);
 
 unsigned target_idcode (target_t *mc);
+int target_chain (target_t *mc, int *tap, unsigned *idcode);
 const char *target_cpu_name (target_t *mc);
 unsigned target_flash_width (target_t *mc);
 unsigned target_main_flash_addr (target_t *mc);
@@ -29,13 +31,26 @@ unsigned target_info_flash_bytes (target_t *mc);
 
 int target_erase (target_t *mc, unsigned addr, int info_flash);
 int target_erase_block (target_t *t, unsigned addr);
+void target_erase_blocks (int n, target_t **t, unsigned *addr);
 void target_program_block (target_t *mc, unsigned addr,
 	unsigned nwords, unsigned *data, int info_flash);
+void target_program_begin (target_t *mc);
+void target_program_next (target_t *mc, unsigned addr,
+	unsigned nwords, unsigned *data, int info_flash);
+int target_program_idle (target_t *mc);
+void target_program_end (target_t *mc);
+unsigned target_skipped_words (target_t *mc);
+int target_checksum (target_t *mc, unsigned addr,
+	unsigned nwords, unsigned *data);
 
 unsigned target_read_word (target_t *mc, unsigned addr);
 void target_read_block (target_t *mc, unsigned addr,
 	unsigned nwords, unsigned *data, int info_flash);
+int target_verify_block (target_t *mc, unsigned addr,
+	unsigned nwords, unsigned *data, int info_flash);
 
 void target_write_word (target_t *mc, unsigned addr, unsigned word);
 void target_write_block (target_t *mc, unsigned addr,
 	unsigned nwords, unsigned *data);
+
+int target_calibrate (target_t *mc);